@@ -0,0 +1,19 @@
+; Measures the heap used by building lists, and the size of the objects of the
+; common types. Run it with `test_repl -l bench/heap.scm'.
+(define make-list (n)
+  (let ((list '()))
+    (dotimes (i n)
+      (set! list (cons i list)))
+    list))
+
+(print (list 'pair (object-size '(1))))
+(print (list 'symbol (object-size 'a)))
+(print (list 'string (object-size "a")))
+(print (list 'vector (object-size [1])))
+(print (list 'float (object-size 1.5)))
+
+(set! before (heap-size))
+(set! lists '())
+(dotimes (i 100)
+  (set! lists (cons (make-list 10000) lists)))
+(print (list 'heap-growth (- (heap-size) before)))
@@ -12,69 +12,309 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <gc/gc.h>
+
 #include "object.h"
 #include "prims.h"
 #include "type.h"
 #include "utilities.h"
+#include "vm.h"
+
+typedef struct emitter_t emitter_t;
+
+// code: The instructions emitted so far
+// last: The last pair of `code', after which the next instructions are linked
+// error: The first compiler error, or NULL
+// tags: The alist from the tags of the enclosing tagbody forms to the pairs of
+//       their labels and the depths of stack there
+// depth: The number of values pushed by the enclosing forms, which stay on the
+//        stack while the current one is evaluated
+struct emitter_t {
+  lt *code;
+  lt *last;
+  lt *error;
+  lt *tags;
+  int depth;
+};
 
 lt *assemble(lt *);
-lt *compile_object(lt *, lt *);
+lt *assemble_code(lt *, int);
+void compile_object(lt *, lt *, int, emitter_t *);
+lt *locate_variable(lt *, lt *);
 
-int is_addr_op(lt *op) {
-  switch (opcode_type(op)) {
-    case JUMP: case FJUMP:
-      return TRUE;
-    default :
-      return FALSE;
+// The value of a form compiled in this context is consumed by
+// `multiple-value-list' or `multiple-value-bind', so all of its values are left
+// on the stack, followed by their count.
+#define MV_CONTEXT 2
+
+// A local variable is represented at compile-time by a vector of its name,
+// whether it is captured by a closure and assigned by `set!', and its slot on
+// the stack relative to the frame. A variable both captured and assigned is
+// shared through a box. The slot is assigned by the assembler.
+#define variable_name(x) (vector_value(x)[0])
+#define variable_is_captured(x) (vector_value(x)[1])
+#define variable_is_assigned(x) (vector_value(x)[2])
+#define variable_slot(x) (vector_value(x)[3])
+
+lt *make_variable(lt *name) {
+  lt *var = make_vector(4);
+  variable_name(var) = name;
+  variable_is_captured(var) = the_false;
+  variable_is_assigned(var) = the_false;
+  variable_slot(var) = the_false;
+  vector_last(var) = 3;
+  return var;
+}
+
+int is_boxed_variable(lt *var) {
+  return variable_is_captured(var) == the_true && variable_is_assigned(var) == the_true;
+}
+
+// The bindings of a frame in the compile-time environment is the list of its
+// variables.
+lt *make_frame(lt *names, lt *next) {
+  lt *vars = the_empty_list;
+  for (; is_lt_pair(names); names = pair_tail(names))
+    vars = make_pair(make_variable(pair_head(names)), vars);
+  return make_environment(lt_list_nreverse(vars), next);
+}
+
+// The frame separating the parameters of a lambda from the environment where it
+// appears. Its bindings is a vector holding the list of the free variables of
+// the lambda, in the order of their slots in the closure.
+lt *make_closure_frame(lt *next) {
+  lt *vars = make_vector(1);
+  vector_value(vars)[0] = the_empty_list;
+  vector_last(vars) = 0;
+  return make_environment(vars, next);
+}
+
+int is_closure_frame(lt *env) {
+  return is_lt_vector(environment_bindings(env));
+}
+
+#define closure_frame_vars(x) (vector_value(environment_bindings(x))[0])
+
+// Returns the index of the slot in the closure for the variable
+lt *capture_variable(lt *frame, lt *var) {
+  int k = 0;
+  lt *vars = closure_frame_vars(frame);
+  for (; is_lt_pair(vars); vars = pair_tail(vars), k++)
+    if (pair_head(vars) == var)
+      return make_fixnum(k);
+  closure_frame_vars(frame) = append2(closure_frame_vars(frame), list1(var));
+  return make_fixnum(k);
+}
+
+// A label is an uninterned symbol owned by the code it appears in, so its value
+// is free to hold the index of the label in the tables used by the optimizer
+// and the assembler, which are arrays instead of alists.
+#define label_index(x) fixnum_value(symbol_value(x))
+
+// Numbers the labels in `code' from zero and returns the count of them
+int number_labels(lt *code) {
+  int n = 0;
+  for (; is_lt_pair(code); code = pair_tail(code))
+    if (is_label(pair_head(code)))
+      symbol_value(pair_head(code)) = make_fixnum(n++);
+  return n;
+}
+
+int get_offset(lt *label, int *offsets) {
+  assert(isfixnum(symbol_value(label)));
+  return offsets[label_index(label)];
+}
+
+char *ins_format(lt *ins) {
+  return opcode_format(opcode_ref(opcode_name(ins)));
+}
+
+// Computes the number of words and constants needed by the instruction stream,
+// and the offset of each label within the stream.
+void asm_first_pass(lt *code, int *offsets, int *length, int *nconstants, int *nhandlers) {
+  int nwords = 0;
+  int nconsts = 0;
+  *nhandlers = 0;
+  while (!isnull(code)) {
+    lt *ins = pair_head(code);
+    if (is_label(ins))
+      offsets[label_index(ins)] = nwords;
+    else if (opcode_name(ins) == CATCH)
+      (*nhandlers)++;
+    else if (opcode_name(ins) != LOCALS) {
+      char *format = ins_format(ins);
+      nwords += 1 + strlen(format);
+      for (; *format != '\0'; format++)
+        if (*format == 'c')
+          nconsts++;
+    }
+    code = pair_tail(code);
   }
+//  The trailing HALT stops the top-level code
+  *length = nwords + 1;
+  *nconstants = nconsts;
 }
 
-lt *get_offset(lt *label, lt *labels) {
-  lt *last_labels = labels;
-  while (!isnull(labels)) {
-    lt *lo = pair_head(labels);
-    if (!isfalse(lt_eq(label, pair_head(lo))))
-      return pair_tail(lo);
-    labels = pair_tail(labels);
+// Returns the number of values pushed onto the operand stack by the instruction
+// minus the number of values popped. The arguments of a CALL are popped by the
+// callee, so they are counted in the callee's code.
+int stack_effect(lt *ins) {
+  switch (opcode_name(ins)) {
+    case CALL: return -fixnum_value(op_call_arity(ins));
+    case TCALL: return -fixnum_value(op_tcall_arity(ins));
+    case MVCALL: return 1 - fixnum_value(op_mvcall_arity(ins));
+    case VALUES: return 1;
+    case CONST: case FN: case GVAR: case LVAR: case CVAR: return 1;
+    case GCALL: case GPRIM: case GTCALL: return 1;
+    case CONS: case EQ: case FJUMP: case POP: return -1;
+    case ADD: case SUB: case MUL: case NUMEQ: case GT: case LT: return -1;
+    case MVSLIDE: return -fixnum_value(op_mvslide_count(ins));
+    case SLIDE: return -fixnum_value(op_slide_count(ins));
+    case PRIM: return -fixnum_value(op_prim_nargs(ins));
+    default : return 0;
   }
-  fprintf(stdout, "Impossible!!! %s not found!\n", symbol_name(label));
-  writef(standard_out, "labels => %?\n", last_labels);
-  exit(1);
 }
 
-lt *change_addr(lt *ins, lt *table) {
-  switch (opcode_type(ins)) {
-    case FJUMP: {
-      lt *label = op_fjump_label(ins);
-      return make_op_fjump(get_offset(label, table));
+// The depth of a label not reached yet
+#define NO_DEPTH -1
+
+void merge_label_depth(lt *label, int depth, int *depths) {
+  if (depths[label_index(label)] < depth)
+    depths[label_index(label)] = depth;
+}
+
+// Computes the maximum depth of operand stack reached by the code relative to
+// the depth at entry, so that the VM only needs to check the stack capacity
+// once when entering the code instead of at each push. The depth at the
+// beginning of each region protected by a handler is recorded as well, and the
+// local variables are given the slots of the values they are bound to. The
+// number of values consumed by MVBIND and MVLIST is only known at run-time, so
+// the depth after them is computed from the depth where the values begin.
+// `depth' is the number of the arguments at entry, and the labels in `code' are
+// numbered by `number_labels' from zero to `nlabels' - 1.
+int max_stack_depth(lt *code, int nlabels, int depth, handler_t *handlers) {
+  int depths[nlabels + 1];
+  for (int i = 0; i < nlabels; i++)
+    depths[i] = NO_DEPTH;
+  int max = 0;
+  int reachable = TRUE;
+  for (; !isnull(code); code = pair_tail(code)) {
+    lt *ins = pair_head(code);
+    if (is_label(ins)) {
+      int known = depths[label_index(ins)];
+      if (known != NO_DEPTH && (!reachable || known > depth))
+        depth = known;
+      merge_label_depth(ins, depth, depths);
+      reachable = TRUE;
+      continue;
     }
-    case JUMP: {
-      lt *label = op_jump_label(ins);
-      return make_op_jump(get_offset(label, table));
+    if (!reachable)
+      continue;
+    depth += stack_effect(ins);
+    switch (opcode_name(ins)) {
+      case FJUMP:
+        merge_label_depth(op_fjump_label(ins), depth, depths);
+        break;
+      case JUMP:
+        merge_label_depth(op_jump_label(ins), depth, depths);
+        reachable = FALSE;
+        break;
+      case RETURN: case VALUES:
+        reachable = FALSE;
+        break;
+      case CATCH:
+        handlers->depth = depth;
+        handlers++;
+        break;
+      case LOCALS: {
+        lt *vars = op_locals_vars(ins);
+        for (int j = depth - pair_length(vars); is_lt_pair(vars); vars = pair_tail(vars), j++)
+          variable_slot(pair_head(vars)) = make_fixnum(j);
+      }
+        break;
+      case MVBIND:
+        depth = depths[label_index(op_mvbind_label(ins))] + fixnum_value(op_mvbind_count(ins));
+        break;
+      case MVLIST:
+        depth = depths[label_index(op_mvlist_label(ins))] + 1;
+        break;
+      default :
+        break;
     }
+    if (depth > max)
+      max = depth;
+  }
+  return max;
+}
+
+// Whether a variable is shared through a box is known only after the whole
+// scope of the variable is compiled, so the instructions accessing it are
+// replaced here.
+enum OPCODE_TYPE final_opcode(lt *ins) {
+  switch (opcode_name(ins)) {
+    case CSET: return is_boxed_variable(op_cset_var(ins))? BCSET: CSET;
+    case CVAR: return is_boxed_variable(op_cvar_var(ins))? BCVAR: CVAR;
+    case LSET: return is_boxed_variable(op_lset_var(ins))? BLSET: LSET;
+    case LVAR: return is_boxed_variable(op_lvar_var(ins))? BLVAR: LVAR;
+    default : return opcode_name(ins);
+  }
+}
+
+// Returns the superinstruction for `first' followed by `second', or `first' if
+// they are not fused. The pairs are the most frequent ones executed by the list
+// functions of init.scm, excluding those across a call or a return.
+enum OPCODE_TYPE fuse_opcodes(enum OPCODE_TYPE first, enum OPCODE_TYPE second) {
+  switch (first) {
+    case CONST:
+      return second == GPRIM? CONST_GPRIM: first;
+    case FJUMP:
+      return second == LVAR? FJUMP_LVAR: first;
+    case GT:
+      return second == FJUMP? GT_FJUMP: first;
+    case LT:
+      return second == FJUMP? LT_FJUMP: first;
+    case LVAR:
+      switch (second) {
+        case CONST: return LVAR_CONST;
+        case GCALL: return LVAR_GCALL;
+        case GPRIM: return LVAR_GPRIM;
+        case LVAR: return LVAR_LVAR;
+        default : return first;
+      }
+    case NUMEQ:
+      return second == FJUMP? NUMEQ_FJUMP: first;
     default :
-      fprintf(stdout, "Invalid instruction to change address\n");
-      exit(1);
+      return first;
   }
 }
 
-lt *asm_first_pass(lt *code) {
-  int length = 0;
-  lt *labels = the_empty_list;
-  while (!isnull(code)) {
-    lt *ins = pair_head(code);
-    if (is_label(ins))
-      labels = make_pair(make_pair(ins, make_fixnum(length)), labels);
-    else
-      length++;
-    code = pair_tail(code);
+// The opcode emitted for the instruction at the head of `code'. An instruction
+// followed by a label is not fused, since the following one may be reached by
+// other paths.
+enum OPCODE_TYPE emitted_opcode(lt *code) {
+  enum OPCODE_TYPE name = final_opcode(pair_head(code));
+  lt *next = pair_tail(code);
+  if (isnull(next) || is_label(pair_head(next)))
+    return name;
+  return fuse_opcodes(name, final_opcode(pair_head(next)));
+}
+
+// The captured local variables are replaced by their slots, which are known
+// after the code creating the closure is assembled.
+void assemble_sources(lt *sources) {
+  for (int k = 0; k < vector_length(sources); k++) {
+    lt *src = vector_value(sources)[k];
+    if (is_lt_vector(src))
+      vector_value(sources)[k] = variable_slot(src);
   }
-  return make_pair(make_fixnum(length), labels);
 }
 
-lt *asm_second_pass(lt *code, lt *length, lt *labels) {
+void asm_second_pass(lt *code, int *offsets, lt *obj) {
+  intptr_t *stream = code_stream(obj);
+  lt **constants = code_constants(obj);
+  handler_t *handler = code_handlers(obj);
   int index = 0;
-  lisp_object_t *code_vector = make_vector(fixnum_value(length));
+  int k = 0;
   while (!isnull(code)) {
     lisp_object_t *ins = pair_head(code);
     if (!is_label(ins)) {
@@ -82,43 +322,504 @@ lt *asm_second_pass(lt *code, lt *length, lt *labels) {
         writef(standard_out, "ins is %?\n", ins);
         assert(is_lt_opcode(ins));
       }
-      if (is_addr_op(ins))
-        ins = change_addr(ins, labels);
-      if (opcode_name(ins) == FN)
-        function_code(op_fn_func(ins)) = assemble(function_code(op_fn_func(ins)));
-      vector_value(code_vector)[index] = ins;
-      vector_last(code_vector)++;
-      index++;
+//      The region protected ends at the label of handler
+      if (opcode_name(ins) == CATCH) {
+        handler->start = index;
+        handler->end = get_offset(op_catch_label(ins), offsets);
+        handler->handler = handler->end;
+        handler++;
+        code = pair_tail(code);
+        continue;
+      }
+      if (opcode_name(ins) == LOCALS) {
+        code = pair_tail(code);
+        continue;
+      }
+      if (opcode_name(ins) == FN) {
+        lt *func = op_fn_func(ins);
+        function_code(func) = assemble_code(function_code(func), function_frame_size(func));
+        assemble_sources(function_env(func));
+      }
+      char *format = ins_format(ins);
+      stream[index++] = vm_opcode_word(emitted_opcode(code));
+      for (int i = 0; format[i] != '\0'; i++) {
+        if (format[i] == 'k') {
+          stream[index++] = i < opcode_length(ins)? (intptr_t)opargn(ins, i): 0;
+          continue;
+        }
+        lt *arg = opargn(ins, i);
+        switch (format[i]) {
+          case 'c':
+            constants[k] = arg;
+            stream[index++] = k++;
+            break;
+          case 'i':
+            stream[index++] = fixnum_value(arg);
+            break;
+          case 'v':
+            stream[index++] = fixnum_value(variable_slot(arg));
+            break;
+          case 'l': {
+            int offset = isfixnum(arg)? fixnum_value(arg): get_offset(arg, offsets);
+            stream[index++] = (intptr_t)(stream + offset);
+          }
+            break;
+          default :
+            fprintf(stdout, "Invalid operand kind %c\n", format[i]);
+            exit(1);
+        }
+      }
     }
     code = pair_tail(code);
   }
-  return code_vector;
+  stream[index] = vm_opcode_word(HALT);
 }
 
-lisp_object_t *assemble(lisp_object_t *code) {
-  assert(is_lt_pair(code));
-  lisp_object_t *ll = asm_first_pass(code);
-  lisp_object_t *length = pair_head(ll);
-  lisp_object_t *labels = pair_tail(ll);
-  code = asm_second_pass(code, length, labels);
+/* Optimizer */
+int is_opcode_of(lt *ins, enum OPCODE_TYPE name) {
+  return is_lt_opcode(ins) && opcode_name(ins) == name;
+}
+
+// Whether the instruction only pushes a value without any other effect
+int is_pure_push(lt *ins) {
+  return is_opcode_of(ins, CONST) ||
+      is_opcode_of(ins, CVAR) ||
+      is_opcode_of(ins, FN) ||
+      is_opcode_of(ins, LVAR);
+}
+
+// Returns the value of the inline operation on constants `x' and `y', or NULL
+// if it should be left to run-time. The fixnums are computed like the VM does.
+lt *fold_inline_op(enum OPCODE_TYPE name, lt *x, lt *y) {
+  if (name == EQ)
+    return lt_eq(x, y);
+  if (!isnumber(x) || !isnumber(y))
+    return NULL;
+  switch (name) {
+    case ADD: return lt_g_add2(x, y);
+    case SUB: return lt_g_sub2(x, y);
+    case MUL: return lt_g_mul2(x, y);
+    case NUMEQ: return lt_g_eq2(x, y);
+    case GT: return lt_gt(x, y);
+    case LT: return lt_gt(y, x);
+    default : return NULL;
+  }
+}
+
+// The primitive functions without side effects, and whose values are not
+// mutable, are called at compile-time on constant arguments they accept.
+int is_foldable_call(lt *prim, lt **args) {
+  void *f = primitive_func(prim);
+  if (f == lt_g_add2 || f == lt_g_sub2 || f == lt_g_mul2 || f == lt_g_eq2 || f == lt_gt)
+    return isnumber(args[0]) && isnumber(args[1]);
+  if (f == lt_char_code)
+    return is_lt_unicode(args[0]);
+  if (f == lt_code_char)
+    return isfixnum(args[0]);
+  return f == lt_eq || f == lt_eql || f == lt_equal;
+}
+
+// Folds a call to a primitive function at the head of `out', which holds the
+// instructions emitted so far in reverse order. The arguments are CONSTs,
+// followed by the CHKTYPEs of the primitive. Returns the rest of `out' with
+// the value pushed, or NULL if it is not foldable.
+lt *fold_primitive_call(lt *out) {
+  int nargs = fixnum_value(op_prim_nargs(pair_head(out)));
+  lt *prim_out = pair_tail(out);
+  if (nargs > 3 || !is_opcode_of(pair_head(prim_out), GPRIM) ||
+      !is_original_fn(op_gprim_var(pair_head(prim_out))))
+    return NULL;
+  lt *prim = symbol_value(op_gprim_var(pair_head(prim_out)));
+  lt *checks = pair_tail(prim_out);
+  lt *rest = checks;
+  while (is_lt_pair(rest) && is_opcode_of(pair_head(rest), CHKTYPE))
+    rest = pair_tail(rest);
+  lt *args[3];
+  for (int i = nargs - 1; i >= 0; i--) {
+    if (!is_lt_pair(rest) || !is_opcode_of(pair_head(rest), CONST))
+      return NULL;
+    args[i] = op_const_value(pair_head(rest));
+    rest = pair_tail(rest);
+  }
+  if (!is_lt_primitive(prim) || primitive_restp(prim) || primitive_arity(prim) != nargs ||
+      !is_foldable_call(prim, args))
+    return NULL;
+  for (; checks != rest && is_opcode_of(pair_head(checks), CHKTYPE); checks = pair_tail(checks)) {
+    lt *ins = pair_head(checks);
+    if (!is_type_satisfy(args[fixnum_value(op_chktype_pos(ins))], fixnum_value(op_chktype_type(ins))))
+      return NULL;
+  }
+  lt *value = NULL;
+  switch (nargs) {
+    case 1: value = ((f1)primitive_func(prim))(args[0]); break;
+    case 2: value = ((f2)primitive_func(prim))(args[0], args[1]); break;
+    case 3: value = ((f3)primitive_func(prim))(args[0], args[1], args[2]); break;
+  }
+  if (value == NULL || is_signaled(value))
+    return NULL;
+  return make_pair(make_op_const(value), rest);
+}
+
+// Rewrites the instructions at the head of `out' after an instruction is
+// appended to it: constant folding, branch folding, and removal of a value
+// pushed only to be popped.
+lt *reduce_instructions(lt *out, int *changed) {
+  lt *ins = pair_head(out);
+  lt *prev = is_lt_pair(pair_tail(out))? pair_head(pair_tail(out)): NULL;
+  if (prev == NULL || !is_lt_opcode(ins))
+    return out;
+  switch (opcode_name(ins)) {
+    case POP:
+      if (is_pure_push(prev)) {
+        *changed = TRUE;
+        return pair_tail(pair_tail(out));
+      }
+      break;
+    case FJUMP:
+      if (is_opcode_of(prev, CONST)) {
+        *changed = TRUE;
+        out = pair_tail(pair_tail(out));
+        if (isfalse(op_const_value(prev)))
+          out = make_pair(make_op_jump(op_fjump_label(ins)), out);
+        return out;
+      }
+      break;
+    case EQ: case ADD: case SUB: case MUL: case NUMEQ: case GT: case LT: {
+      lt *rest = pair_tail(pair_tail(out));
+      if (!is_opcode_of(prev, CONST) || !is_lt_pair(rest) || !is_opcode_of(pair_head(rest), CONST))
+        break;
+      lt *value = fold_inline_op(opcode_name(ins), op_const_value(pair_head(rest)), op_const_value(prev));
+      if (value != NULL && !is_signaled(value)) {
+        *changed = TRUE;
+        return make_pair(make_op_const(value), pair_tail(rest));
+      }
+    }
+      break;
+    case PRIM: {
+      lt *folded = fold_primitive_call(out);
+      if (folded != NULL) {
+        *changed = TRUE;
+        return folded;
+      }
+    }
+      break;
+    default :
+      break;
+  }
+  return out;
+}
+
+lt *peephole(lt *code, int *changed) {
+  lt *out = the_empty_list;
+  for (; is_lt_pair(code); code = pair_tail(code))
+    out = reduce_instructions(make_pair(pair_head(code), out), changed);
+  return lt_list_nreverse(out);
+}
+
+// Returns the instructions following `label', skipping the labels. `targets'
+// maps the index of each label to the pair of code where it appears.
+lt *label_target(lt *label, lt **targets) {
+  lt *code = targets[label_index(label)];
+  while (is_lt_pair(code) && is_label(pair_head(code)))
+    code = pair_tail(code);
+  return code;
+}
+
+// Follows the chain of JUMPs starting from `label'. The number of steps is
+// bounded, since the chain may be a loop.
+lt *final_label(lt *label, lt **targets) {
+  for (int i = 0; i < 16; i++) {
+    lt *target = label_target(label, targets);
+    if (!is_lt_pair(target) || !is_opcode_of(pair_head(target), JUMP))
+      break;
+    label = op_jump_label(pair_head(target));
+  }
+  return label;
+}
+
+// A jump is redirected to the end of the chain of jumps it starts, and a JUMP to
+// a RETURN is replaced by the RETURN.
+lt *thread_jumps(lt *code, int *changed) {
+  lt **targets = GC_MALLOC((number_labels(code) + 1) * sizeof(lt *));
+  for (lt *rest = code; is_lt_pair(rest); rest = pair_tail(rest))
+    if (is_label(pair_head(rest)))
+      targets[label_index(pair_head(rest))] = rest;
+  for (lt *rest = code; is_lt_pair(rest); rest = pair_tail(rest)) {
+    lt *ins = pair_head(rest);
+    if (is_opcode_of(ins, JUMP)) {
+      lt *label = final_label(op_jump_label(ins), targets);
+      lt *target = label_target(label, targets);
+      if (is_lt_pair(target) && is_opcode_of(pair_head(target), RETURN)) {
+        pair_head(rest) = make_op_return();
+        *changed = TRUE;
+      } else if (label != op_jump_label(ins)) {
+        pair_head(rest) = make_op_jump(label);
+        *changed = TRUE;
+      }
+    } else if (is_opcode_of(ins, FJUMP)) {
+      lt *label = final_label(op_fjump_label(ins), targets);
+      if (label != op_fjump_label(ins)) {
+        pair_head(rest) = make_op_fjump(label);
+        *changed = TRUE;
+      }
+    }
+  }
   return code;
 }
 
-lisp_object_t *gen(enum TYPE opcode, ...) {
+// Marks in `referenced' the labels which are the operands of the instructions
+void mark_referenced_labels(lt *code, char *referenced) {
+  for (; is_lt_pair(code); code = pair_tail(code)) {
+    lt *ins = pair_head(code);
+    if (is_label(ins))
+      continue;
+    switch (opcode_name(ins)) {
+      case CATCH: case FJUMP: case JUMP: case MVLIST:
+        referenced[label_index(oparg1(ins))] = TRUE;
+        break;
+      case MVBIND:
+        referenced[label_index(op_mvbind_label(ins))] = TRUE;
+        break;
+      default :
+        break;
+    }
+  }
+}
+
+// Removes the labels not referenced, the instructions which can not be reached
+// after an unconditional transfer, and the JUMPs to the following instruction.
+lt *remove_dead_code(lt *code, int *changed) {
+  lt *out = the_empty_list;
+  int reachable = TRUE;
+  char *referenced = GC_MALLOC_ATOMIC(number_labels(code) + 1);
+  mark_referenced_labels(code, referenced);
+  for (lt *rest = code; is_lt_pair(rest); rest = pair_tail(rest)) {
+    lt *ins = pair_head(rest);
+    if (is_label(ins)) {
+      if (!referenced[label_index(ins)]) {
+        *changed = TRUE;
+        continue;
+      }
+      reachable = TRUE;
+    } else if (!reachable) {
+      *changed = TRUE;
+      continue;
+    } else if (is_opcode_of(ins, JUMP)) {
+      lt *next = pair_tail(rest);
+      while (is_lt_pair(next) && is_label(pair_head(next)) && pair_head(next) != op_jump_label(ins))
+        next = pair_tail(next);
+      if (is_lt_pair(next) && pair_head(next) == op_jump_label(ins)) {
+        *changed = TRUE;
+        continue;
+      }
+      reachable = FALSE;
+    } else if (is_opcode_of(ins, RETURN) || is_opcode_of(ins, VALUES))
+      reachable = FALSE;
+    out = make_pair(ins, out);
+  }
+  return lt_list_nreverse(out);
+}
+
+// Whether a value satisfying the predicate `known', or undef, satisfies `pred'
+// as well. Both are type masks.
+int is_pred_implied(lt *known, lt *pred) {
+  intptr_t mask = fixnum_value(pred);
+  if (mask == ALL_TYPES_MASK)
+    return TRUE;
+  return known != the_undef && (fixnum_value(known) & ~mask) == 0;
+}
+
+// A fact is a pair of the type mask of a value on the stack, or undef, and the
+// local variable it is loaded from, or undef.
+lt *make_fact(lt *pred, lt *var) {
+  return make_pair(pred, var);
+}
+
+lt *make_type_fact(enum TYPE type) {
+  return make_fact(make_fixnum(TYPE_BIT(type)), the_undef);
+}
+
+// Returns the fact of the value `n' slots below the top of stack, or NULL if
+// nothing is known about it
+lt *fact_at(lt *facts, int n) {
+  for (; is_lt_pair(facts); facts = pair_tail(facts), n--)
+    if (n == 0)
+      return pair_head(facts);
+  return NULL;
+}
+
+lt *drop_facts(lt *facts, int n) {
+  for (; is_lt_pair(facts) && n > 0; n--)
+    facts = pair_tail(facts);
+  return facts;
+}
+
+lt *variable_pred(lt *var, lt *preds) {
+  for (; is_lt_pair(preds); preds = pair_tail(preds))
+    if (pair_head(pair_head(preds)) == var)
+      return pair_tail(pair_head(preds));
+  return the_undef;
+}
+
+// The value on the stack becomes the one of `var', and the ones loaded from it
+// before are not any more. When nothing is known about the value, the
+// predicate known before for `var' is shadowed by undef.
+lt *bind_fact(lt *fact, lt *var, lt *facts, lt *preds) {
+  for (; is_lt_pair(facts); facts = pair_tail(facts))
+    if (pair_tail(pair_head(facts)) == var)
+      pair_tail(pair_head(facts)) = the_undef;
+  if (is_boxed_variable(var))
+    return preds;
+  if (fact == NULL)
+    return make_pair(make_pair(var, the_undef), preds);
+  pair_tail(fact) = var;
+  return make_pair(make_pair(var, pair_head(fact)), preds);
+}
+
+lt *primitive_result_pred(lt *fact) {
+  if (fact == NULL || !is_lt_symbol(pair_tail(fact)))
+    return the_undef;
+  lt *prim = symbol_value(pair_tail(fact));
+  return is_lt_primitive(prim)? primitive_return_type(prim): the_undef;
+}
+
+// Removes the CHKTYPEs whose arguments are known to satisfy the predicates, by
+// following the types of the values on the stack along each path. They come
+// from the constants, the primitive functions declaring their return types, and
+// the CHKTYPEs already run for the same value or unboxed variable. Nothing is
+// known after a label, where the paths join, or after an instruction not
+// interpreted here.
+lt *remove_type_checks(lt *code) {
+  lt *out = the_empty_list;
+//  The facts of the values on the stack, from the top. The ones below are unknown.
+  lt *facts = the_empty_list;
+//  The predicates known to be satisfied by the unboxed local variables
+  lt *preds = the_empty_list;
+  for (; is_lt_pair(code); code = pair_tail(code)) {
+    lt *ins = pair_head(code);
+    if (!is_lt_opcode(ins)) {
+      facts = preds = the_empty_list;
+      out = make_pair(ins, out);
+      continue;
+    }
+    switch (opcode_name(ins)) {
+      case CHKTYPE: {
+        int n = fixnum_value(op_chktype_nargs(ins)) - 1 - fixnum_value(op_chktype_pos(ins));
+        lt *fact = fact_at(facts, n);
+        lt *pred = op_chktype_type(ins);
+        if (is_pred_implied(fact == NULL? the_undef: pair_head(fact), pred))
+          continue;
+        if (fact != NULL) {
+          pair_head(fact) = pred;
+          if (pair_tail(fact) != the_undef)
+            preds = make_pair(make_pair(pair_tail(fact), pred), preds);
+        }
+      }
+        break;
+      case CONST:
+        facts = make_pair(make_type_fact(type_of(op_const_value(ins))), facts);
+        break;
+      case GPRIM:
+        facts = make_pair(make_fact(the_undef, op_gprim_var(ins)), facts);
+        break;
+      case LVAR: {
+        lt *var = op_lvar_var(ins);
+        if (is_boxed_variable(var))
+          facts = make_pair(make_fact(the_undef, the_undef), facts);
+        else
+          facts = make_pair(make_fact(variable_pred(var, preds), var), facts);
+      }
+        break;
+      case LSET:
+        preds = bind_fact(fact_at(facts, 0), op_lset_var(ins), facts, preds);
+        break;
+      case LOCALS: {
+        lt *vars = op_locals_vars(ins);
+        int n = pair_length(vars);
+        for (int k = 0; is_lt_pair(vars); vars = pair_tail(vars), k++)
+          preds = bind_fact(fact_at(facts, n - 1 - k), pair_head(vars), facts, preds);
+      }
+        break;
+      case PRIM: {
+        lt *pred = primitive_result_pred(fact_at(facts, 0));
+        facts = drop_facts(facts, fixnum_value(op_prim_nargs(ins)) + 1);
+        facts = make_pair(make_fact(pred, the_undef), facts);
+      }
+        break;
+      case CONS:
+        facts = make_pair(make_type_fact(LT_PAIR), drop_facts(facts, 2));
+        break;
+      case EQ: case NUMEQ: case GT: case LT:
+        facts = make_pair(make_type_fact(LT_BOOL), drop_facts(facts, 2));
+        break;
+      case ADD: case SUB: case MUL:
+        facts = make_pair(make_fact(the_undef, the_undef), drop_facts(facts, 2));
+        break;
+      case FJUMP: case POP:
+        facts = drop_facts(facts, 1);
+        break;
+      case SLIDE: {
+        lt *top = fact_at(facts, 0);
+        facts = drop_facts(facts, fixnum_value(op_slide_count(ins)) + 1);
+        facts = make_pair(top == NULL? make_fact(the_undef, the_undef): top, facts);
+      }
+        break;
+      case BOX: case CATCH:
+        break;
+      default :
+        facts = the_empty_list;
+    }
+    out = make_pair(ins, out);
+  }
+  return lt_list_nreverse(out);
+}
+
+// Repeats the optimizations until none of them applies
+lt *optimize(lt *code) {
+  int changed;
+  do {
+    changed = FALSE;
+    code = peephole(code, &changed);
+    code = thread_jumps(code, &changed);
+    code = remove_dead_code(code, &changed);
+  } while (changed);
+  return remove_type_checks(code);
+}
+
+// `nargs' is the number of the slots of arguments at the bottom of the stack
+lt *assemble_code(lt *code, int nargs) {
+  code = optimize(code);
+  assert(is_lt_pair(code));
+  int length, nconstants, nhandlers;
+  int nlabels = number_labels(code);
+  int offsets[nlabels + 1];
+  asm_first_pass(code, offsets, &length, &nconstants, &nhandlers);
+  intptr_t *stream = GC_MALLOC(length * sizeof(intptr_t));
+  lt **constants = GC_MALLOC(nconstants * sizeof(lt *));
+  handler_t *handlers = GC_MALLOC_ATOMIC(nhandlers * sizeof(handler_t));
+  lt *obj = make_code(length, stream, constants, max_stack_depth(code, nlabels, nargs, handlers));
+  code_nhandlers(obj) = nhandlers;
+  code_handlers(obj) = handlers;
+  asm_second_pass(code, offsets, obj);
+  return obj;
+}
+
+lisp_object_t *assemble(lisp_object_t *code) {
+  return assemble_code(code, 0);
+}
+
+lisp_object_t *gen(enum OPCODE_TYPE opcode, ...) {
   va_list ap;
   va_start(ap, opcode);
   lisp_object_t *ins;
   switch (opcode) {
+    case BOX: ins = make_op_box(va_arg(ap, lt *)); break;
     case CALL:
       ins = make_op_call(va_arg(ap, lisp_object_t *));
       break;
     case CATCH:
-      ins = make_op_catch();
-      break;
-    case CHECKEX:
-      ins = make_op_checkex();
+      ins = make_op_catch(va_arg(ap, lt *));
       break;
-    case CHKARITY: ins = make_op_chkarity(va_arg(ap, lt *)); break;
     case CHKTYPE: {
       lt *position = va_arg(ap, lt *);
       lt *type = va_arg(ap, lt *);
@@ -131,10 +832,16 @@ lisp_object_t *gen(enum TYPE opcode, ...) {
       ins = make_op_const(value);
     }
       break;
-    case CUTSTACK: ins = make_op_cutstack(); break;
-    case EXTENV: {
-      lt *count = va_arg(ap, lt *);
-      ins = make_op_extenv(count);
+    case CSET: {
+      lt *index = va_arg(ap, lt *);
+      lt *var = va_arg(ap, lt *);
+      ins = make_op_cset(index, var);
+    }
+      break;
+    case CVAR: {
+      lt *index = va_arg(ap, lt *);
+      lt *var = va_arg(ap, lt *);
+      ins = make_op_cvar(index, var);
     }
       break;
     case FJUMP: {
@@ -145,9 +852,12 @@ lisp_object_t *gen(enum TYPE opcode, ...) {
     case FN:
       ins = make_op_fn(va_arg(ap, lisp_object_t *));
       break;
+    case GCALL: ins = make_op_gcall(va_arg(ap, lt *)); break;
+    case GPRIM: ins = make_op_gprim(va_arg(ap, lt *)); break;
     case GSET:
       ins = make_op_gset(va_arg(ap, lisp_object_t *));
       break;
+    case GTCALL: ins = make_op_gtcall(va_arg(ap, lt *)); break;
     case GVAR:
       ins = make_op_gvar(va_arg(ap, lisp_object_t *));
       break;
@@ -156,42 +866,29 @@ lisp_object_t *gen(enum TYPE opcode, ...) {
       ins = make_op_jump(label);
     }
       break;
-    case LSET: {
-      lisp_object_t *i = va_arg(ap, lisp_object_t *);
-      lisp_object_t *j = va_arg(ap, lisp_object_t *);
-      lisp_object_t *symbol = va_arg(ap, lisp_object_t *);
-      ins = make_op_lset(i, j, symbol);
-    }
-      break;
-    case LVAR: {
-      lisp_object_t *i = va_arg(ap, lisp_object_t *);
-      lisp_object_t *j = va_arg(ap, lisp_object_t *);
-      lisp_object_t *symbol = va_arg(ap, lisp_object_t *);
-      ins = make_op_lvar(i, j, symbol);
-    }
-      break;
-    case MOVEARGS: {
+    case LOCALS: ins = make_op_locals(va_arg(ap, lt *)); break;
+    case LSET: ins = make_op_lset(va_arg(ap, lt *)); break;
+    case LVAR: ins = make_op_lvar(va_arg(ap, lt *)); break;
+    case MVBIND: {
       lt *count = va_arg(ap, lt *);
-      ins = make_op_moveargs(count);
+      lt *label = va_arg(ap, lt *);
+      ins = make_op_mvbind(count, label);
     }
       break;
-    case MVLIST: ins = make_op_mvlist(); break;
+    case MVCALL: ins = make_op_mvcall(va_arg(ap, lt *)); break;
+    case MVLIST: ins = make_op_mvlist(va_arg(ap, lt *)); break;
+    case MVSLIDE: ins = make_op_mvslide(va_arg(ap, lt *)); break;
     case POP:
       ins = make_op_pop();
       break;
-    case POPENV:
-      ins = make_op_popenv();
-      break;
     case PRIM:
       ins = make_op_prim(va_arg(ap, lisp_object_t *));
       break;
-    case RESTARGS:
-      ins = make_op_restargs(va_arg(ap, lt *));
-      break;
     case RETURN:
       ins = make_op_return();
       break;
-    case SETMV: ins = make_op_setmv(); break;
+    case SLIDE: ins = make_op_slide(va_arg(ap, lt *)); break;
+    case TCALL: ins = make_op_tcall(va_arg(ap, lt *)); break;
     case VALUES: ins = make_op_values(va_arg(ap, lt *)); break;
     default:
       fprintf(stdout, "Invalid opcode %d\n", opcode);
@@ -200,6 +897,57 @@ lisp_object_t *gen(enum TYPE opcode, ...) {
   return make_pair(ins, make_empty_list());
 }
 
+// The compiler emits the instructions in order to the end of a list, so that
+// the time of compiling is linear to the length of code.
+emitter_t *make_emitter(void) {
+  emitter_t *e = GC_MALLOC(sizeof(emitter_t));
+  e->code = the_empty_list;
+  e->last = NULL;
+  e->error = NULL;
+  e->tags = the_empty_list;
+  e->depth = 0;
+  return e;
+}
+
+// Links the list of instructions `code' to the end of the emitted ones
+void emit(emitter_t *e, lt *code) {
+  if (!is_lt_pair(code))
+    return;
+  if (e->last == NULL)
+    e->code = code;
+  else
+    pair_tail(e->last) = code;
+  for (e->last = code; is_lt_pair(pair_tail(e->last)); e->last = pair_tail(e->last))
+    ;
+}
+
+// Inserts the instructions `code' after the pair `mark' of the emitted ones
+void emit_after(emitter_t *e, lt *mark, lt *code) {
+  if (!is_lt_pair(code))
+    return;
+  lt *last = code;
+  while (is_lt_pair(pair_tail(last)))
+    last = pair_tail(last);
+  pair_tail(last) = pair_tail(mark);
+  pair_tail(mark) = code;
+  if (e->last == mark)
+    e->last = last;
+}
+
+// Only the first error is kept, and the compiling goes on without effect
+void emit_error(emitter_t *e, char *message) {
+  if (e->error == NULL)
+    e->error = make_exception(message, TRUE, the_compiler_error_symbol, the_empty_list);
+}
+
+// The count of the single value is needed only in MV_CONTEXT
+lt *gen_count(int is_tail) {
+  if (is_tail == MV_CONTEXT)
+    return gen(CONST, make_fixnum(1));
+  else
+    return the_empty_list;
+}
+
 int is_all_symbol(lisp_object_t *list) {
   while (!isnull(list)) {
     if (!is_lt_symbol(pair_head(list)))
@@ -218,45 +966,48 @@ int islength1(lisp_object_t *list) {
 // argument would be pushed to operand stack first.
 // The order of arguments on the operand stack from top to bottom, is opposite
 // to the order of arguments in environment binding from left to right.
-lisp_object_t *compile_args(lisp_object_t *args, lisp_object_t *env) {
-  if (isnull(args))
-    return the_empty_list;
-  else {
-    lt *arg = compile_object(pair_head(args), env);
-    if (is_signaled(arg))
-      return arg;
-    else
-      return append2(arg, compile_args(pair_tail(args), env));
+// The arguments are counted in the depth of `e' until the caller consumes them.
+void compile_args(lisp_object_t *args, lisp_object_t *env, emitter_t *e) {
+  for (; is_lt_pair(args); args = pair_tail(args)) {
+    compile_object(pair_head(args), env, FALSE, e);
+    e->depth++;
   }
 }
 
-lisp_object_t *compile_begin(lisp_object_t *exps, lisp_object_t *env) {
-  if (isnull(exps))
-    return gen(CONST, the_empty_list);
-  else if (islength1(exps))
-    return compile_object(first(exps), env);
-  else {
-    lisp_object_t *st = compile_object(first(exps), env);
-    lt *nd = gen(POP);
-    lisp_object_t *rd = compile_begin(pair_tail(exps), env);
-    return seq(st, nd, rd);
+// If `is_tail' is true, the value of the last expression is returned from the
+// function directly, so a call there can be compiled as a tail call.
+void compile_begin(lisp_object_t *exps, lisp_object_t *env, int is_tail, emitter_t *e) {
+  if (isnull(exps)) {
+    emit(e, gen(CONST, the_empty_list));
+    return;
   }
+  for (; !islength1(exps); exps = pair_tail(exps)) {
+    compile_object(first(exps), env, FALSE, e);
+    emit(e, gen(POP));
+  }
+  compile_object(first(exps), env, is_tail, e);
 }
 
-lt *gen_args(lt *args, int nrequired) {
-  if (isnull(args))
-    return seq(gen(CHKARITY, make_fixnum(nrequired)),
-        gen(MOVEARGS, make_fixnum(nrequired)));
-  else if (is_lt_symbol(args)) {
-    return seq(gen(RESTARGS, make_fixnum(nrequired)),
-        gen(CHKARITY, make_fixnum(nrequired)),
-        gen(MOVEARGS, make_fixnum(nrequired + 1)));
-  } else if (is_lt_pair(args) && is_lt_symbol(pair_head(args))) {
-    return gen_args(pair_tail(args), nrequired + 1);
-  } else {
+// Computes the arity descriptor of a parameters list. The arguments are checked
+// and moved into the new environment by CALL and TCALL according to it.
+void parse_args(lt *args, int *nrequired, int *restp) {
+  *nrequired = 0;
+  while (is_lt_pair(args) && is_lt_symbol(pair_head(args))) {
+    (*nrequired)++;
+    args = pair_tail(args);
+  }
+  if (!isnull(args) && !is_lt_symbol(args)) {
     printf("Illegal argument list");
     exit(1);
   }
+  *restp = is_lt_symbol(args);
+}
+
+int is_symbol_list(lt *list) {
+  for (; is_lt_pair(list); list = pair_tail(list))
+    if (!is_lt_symbol(pair_head(list)))
+      return FALSE;
+  return isnull(list);
 }
 
 lt *make_proper_args(lt *args) {
@@ -268,34 +1019,93 @@ lt *make_proper_args(lt *args) {
     return make_pair(pair_head(args), make_proper_args(pair_tail(args)));
 }
 
-lt *compile_lambda(lt *args, lt *body, lt *env) {
-  lt *arg_ins = gen_args(args, 0);
-  env = make_environment(make_proper_args(args), env);
-  lisp_object_t *code =
-      seq(arg_ins,
-          compile_begin(body, env),
-          gen(RETURN));
-  lisp_object_t *func = make_function(args, code, env);
+// Boxes the variables of the innermost frame shared by closures and assignments
+lt *gen_boxes(lt *vars) {
+  lt *code = the_empty_list;
+  for (; is_lt_pair(vars); vars = pair_tail(vars))
+    if (is_boxed_variable(pair_head(vars)))
+      code = make_pair(make_op_box(pair_head(vars)), code);
+  return lt_list_nreverse(code);
+}
+
+// The values on the top of stack are bound to the variables of `frame' within
+// the code of the body, and dropped afterwards. In tail position they are
+// dropped by RETURN along with the arguments. The variables to be boxed are
+// known after the body is compiled, so the boxes are inserted after LOCALS then.
+void compile_scope(lt *frame, lt *body, int is_tail, emitter_t *e) {
+  lt *vars = environment_bindings(frame);
+  lt *count = make_fixnum(pair_length(vars));
+  emit(e, gen(LOCALS, vars));
+  lt *mark = e->last;
+  compile_begin(body, frame, is_tail, e);
+  emit_after(e, mark, gen_boxes(vars));
+  if (isnull(vars) || is_tail == TRUE)
+    return;
+  else if (is_tail == MV_CONTEXT)
+    emit(e, gen(MVSLIDE, count));
+  else
+    emit(e, gen(SLIDE, count));
+}
+
+// Describes where the values of the captured variables are copied from when
+// the closure is created in `env'. Each one is either the slot of a local
+// variable, or a list (k) for the k-th value in the closure of the enclosing
+// function. The slots are filled in by the assembler.
+lt *capture_sources(lt *vars, lt *env) {
+  lt *sources = make_vector(pair_length(vars));
+  for (int k = 0; is_lt_pair(vars); vars = pair_tail(vars), k++) {
+    lt *loc = locate_variable(variable_name(pair_head(vars)), env);
+    if (isnull(pair_tail(loc)))
+      vector_value(sources)[k] = pair_head(loc);
+    else
+      vector_value(sources)[k] = pair_tail(loc);
+  }
+  vector_last(sources) = vector_length(sources) - 1;
+  return sources;
+}
+
+// The free variables of the lambda are collected while compiling its body,
+// and only they are copied into the closure. The arguments stay on the stack
+// as the first slots of the frame.
+lt *compile_lambda(lt *args, lt *body, lt *env, emitter_t *e) {
+  int nrequired, restp;
+  parse_args(args, &nrequired, &restp);
+  lt *boundary = make_closure_frame(env);
+  lt *frame = make_frame(make_proper_args(args), boundary);
+  emitter_t *fe = make_emitter();
+  compile_scope(frame, body, TRUE, fe);
+  emit(fe, gen(RETURN));
+  if (fe->error != NULL && e->error == NULL)
+    e->error = fe->error;
+  lt *sources = capture_sources(closure_frame_vars(boundary), env);
+  lisp_object_t *func = make_function(args, fe->code, sources);
+  if (isnull_env(env))
+    function_body(func) = body;
+  function_nrequired(func) = nrequired;
+  function_restp(func) = restp;
+  function_frame_size(func) = nrequired + restp;
   return func;
 }
 
+// The labels are not interned, so compiling does not fill up the package
 lisp_object_t *make_label(void) {
   static int label_count = 1;
   static char buffer[256];
   int i = sprintf(buffer, "L%d", label_count);
   label_count++;
-  return S(strndup(buffer, i));
+  return make_symbol(strndup(buffer, i), package);
 }
 
-lt *compile_if(lt *pred, lt *then, lt *else_part, lt *env) {
+void compile_if(lt *pred, lt *then, lt *else_part, lt *env, int is_tail, emitter_t *e) {
   lisp_object_t *l1 = make_label();
   lisp_object_t *l2 = make_label();
-  pred = compile_object(pred, env);
-  then = compile_object(then, env);
-  else_part = compile_object(else_part, env);
-  lisp_object_t *fj = gen(FJUMP, l1);
-  lisp_object_t *j = gen(JUMP, l2);
-  return seq(pred, fj, then, j, list1(l1), else_part, list1(l2));
+  compile_object(pred, env, FALSE, e);
+  emit(e, gen(FJUMP, l1));
+  compile_object(then, env, is_tail, e);
+  emit(e, gen(JUMP, l2));
+  emit(e, list1(l1));
+  compile_object(else_part, env, is_tail, e);
+  emit(e, list1(l2));
 }
 
 lisp_object_t *is_var_in_frame(lisp_object_t *var, lisp_object_t *bindings) {
@@ -303,7 +1113,7 @@ lisp_object_t *is_var_in_frame(lisp_object_t *var, lisp_object_t *bindings) {
   if (is_lt_pair(bindings)) {
     int j = 0;
     while (!isnull(bindings)) {
-      if (!isfalse(lt_eq(var, pair_head(bindings))))
+      if (!isfalse(lt_eq(var, variable_name(pair_head(bindings)))))
         return make_fixnum(j);
       bindings = pair_tail(bindings);
       j++;
@@ -312,43 +1122,62 @@ lisp_object_t *is_var_in_frame(lisp_object_t *var, lisp_object_t *bindings) {
   return NULL;
 }
 
+// Returns the variable bound to `symbol' lexically, or NULL for a global one
 lisp_object_t *is_var_in_env(lisp_object_t *symbol, lisp_object_t *env) {
   assert(is_lt_symbol(symbol));
   assert(is_lt_environment(env) || isnull_env(env));
-  int i = 0;
-  while (!isnull_env(env)) {
-    lt *bindings = environment_bindings(env);
-    assert(isnull(bindings) || is_lt_pair(bindings) || is_lt_vector(bindings));
-    lisp_object_t *j = is_var_in_frame(symbol, bindings);
+  for (; !isnull_env(env); env = environment_next(env)) {
+    if (is_closure_frame(env))
+      continue;
+    lt *j = is_var_in_frame(symbol, environment_bindings(env));
     if (j != NULL)
-      return make_pair(make_fixnum(i), j);
-    env = environment_next(env);
-    i++;
+      return lt_raw_nth(environment_bindings(env), fixnum_value(j));
+  }
+  return NULL;
+}
+
+// Returns a list (variable) if the variable is bound in the function being
+// compiled, or (variable k) if it is free in the function and copied into the
+// k-th slot of its closure. Returns NULL if it is a global variable.
+lt *locate_variable(lt *symbol, lt *env) {
+  for (; !isnull_env(env); env = environment_next(env)) {
+    if (is_closure_frame(env)) {
+      lt *loc = locate_variable(symbol, environment_next(env));
+      if (loc == NULL)
+        return NULL;
+      lt *var = pair_head(loc);
+      variable_is_captured(var) = the_true;
+      return list2(var, capture_variable(env, var));
+    }
+    lt *j = is_var_in_frame(symbol, environment_bindings(env));
+    if (j != NULL)
+      return list1(lt_raw_nth(environment_bindings(env), fixnum_value(j)));
   }
   return NULL;
 }
 
 lisp_object_t *gen_set(lisp_object_t *symbol, lisp_object_t *env) {
-  lisp_object_t *co = is_var_in_env(symbol, env);
-  if (co == NULL)
+  lt *loc = locate_variable(symbol, env);
+  if (loc == NULL)
     return gen(GSET, symbol);
-  else {
-    lisp_object_t *i = pair_head(co);
-    lisp_object_t *j = pair_tail(co);
-    return gen(LSET, i, j, symbol);
-  }
+  lt *var = pair_head(loc);
+  variable_is_assigned(var) = the_true;
+  if (isnull(pair_tail(loc)))
+    return gen(LSET, var);
+  else
+    return gen(CSET, second(loc), var);
 }
 
 lisp_object_t *gen_var(lisp_object_t *symbol, lisp_object_t *env) {
   assert(is_lt_environment(env) || isnull_env(env));
-  lisp_object_t *co = is_var_in_env(symbol, env);
-  if (co == NULL)
+  lt *loc = locate_variable(symbol, env);
+  if (loc == NULL)
     return gen(GVAR, symbol);
-  else {
-    lisp_object_t *i = pair_head(co);
-    lisp_object_t *j = pair_tail(co);
-    return gen(LVAR, i, j, symbol);
-  }
+  lt *var = pair_head(loc);
+  if (isnull(pair_tail(loc)))
+    return gen(LVAR, var);
+  else
+    return gen(CVAR, second(loc), var);
 }
 
 int is_primitive_fun_name(lt *variable, lt *env) {
@@ -366,7 +1195,7 @@ lt *compile_type_check(lt *prim, lt *nargs) {
   int i = 0;
   while (!isnull(sig)) {
     lt *pred = pair_head(sig);
-    seq = append2(gen(CHKTYPE, make_fixnum(i), pred, nargs), seq);
+    seq = make_pair(pair_head(gen(CHKTYPE, make_fixnum(i), pred, nargs)), seq);
     sig = pair_tail(sig);
     i++;
   }
@@ -384,173 +1213,470 @@ int is_argc_satisfy(int argc, lt *prim_name) {
     return argc == arity;
 }
 
-lt *compiler_error(char *message) {
-  return make_exception(message, TRUE, the_compiler_error_symbol, the_empty_list);
+// Returns the pair of the label which `tag' is replaced by and the depth of
+// stack there, or NULL
+lt *tag_target(lt *tag, lt *tags) {
+  for (; is_lt_pair(tags); tags = pair_tail(tags))
+    if (pair_head(pair_head(tags)) == tag)
+      return pair_tail(pair_head(tags));
+  return NULL;
 }
 
-lt *compile_tagbody(lt *forms, lt *env) {
-  if (isnull(forms))
-    return make_empty_list();
-  else {
+// Each tag is replaced by a label of its own, so a tagbody can be compiled more
+// than once into the same code, as an inlined function does. The value of each
+// form is dropped except the last one, so that the depth of stack is the same
+// at every tag, and the value is () if the last one is a tag.
+void compile_tagbody(lt *forms, lt *env, emitter_t *e) {
+  lt *outer = e->tags;
+  lt *depth = make_fixnum(e->depth);
+  for (lt *rest = forms; is_lt_pair(rest); rest = pair_tail(rest))
+    if (is_lt_symbol(pair_head(rest)))
+      e->tags = make_pair(make_pair(pair_head(rest), make_pair(make_label(), depth)), e->tags);
+  int has_value = FALSE;
+  for (; is_lt_pair(forms); forms = pair_tail(forms)) {
     lt *form = pair_head(forms);
+    if (has_value)
+      emit(e, gen(POP));
+    has_value = !is_lt_symbol(form);
     if (is_lt_symbol(form))
-      return seq(list1(form), compile_tagbody(pair_tail(forms), env));
-    else {
-      lt *part1 = compile_object(form, env);
-      return seq(part1, compile_tagbody(pair_tail(forms), env));
-    }
+      emit(e, list1(pair_head(tag_target(form, e->tags))));
+    else
+      compile_object(form, env, FALSE, e);
   }
+  if (!has_value)
+    emit(e, gen(CONST, the_empty_list));
+  e->tags = outer;
 }
 
-int is_single_gvar(lt *seq) {
-  return isnull(pair_tail(seq)) && opcode_type(pair_head(seq)) == GVAR;
+// The values pushed since the tagbody of the tag, such as the local variables
+// of the let forms within it, are dropped before jumping to the tag.
+void compile_goto(lt *tag, emitter_t *e) {
+  lt *target = tag_target(tag, e->tags);
+  if (target == NULL) {
+    emit_error(e, "The tag of a goto form must be in an enclosing tagbody");
+    return;
+  }
+  for (int n = e->depth - fixnum_value(pair_tail(target)); n > 0; n--)
+    emit(e, gen(POP));
+  emit(e, gen(JUMP, pair_head(target)));
 }
 
-lt *compile_checkex(void) {
-  return is_check_exception? gen(CHECKEX): the_empty_list;
+// All the functions having an opcode take two arguments. A call to a function
+// bound locally is not replaced, because it may not be the global one.
+int is_inline_op(lt *proc, lt *nargs, lt *env) {
+  return is_lt_symbol(proc) &&
+      fixnum_value(nargs) == 2 &&
+      isopcode_fn(proc) &&
+      is_var_in_env(proc, env) == NULL;
 }
 
-lt *compile_app(lt *proc, lt *args, lt *env) {
+int is_global_fun_name(lt *proc, lt *env) {
+  return is_lt_symbol(proc) && is_var_in_env(proc, env) == NULL;
+}
+
+// The number of nodes allowed in the body of an inlined function, and the
+// number of calls inlined into each other, which stops a recursive function
+#define INLINE_MAX_SIZE 8
+#define INLINE_MAX_DEPTH 4
+
+// The global functions inlined while compiling a top-level definition, or NULL
+static lt *inlined_globals = NULL;
+static int inline_depth = 0;
+
+int is_parameter(lt *symbol, lt *pars) {
+  for (; is_lt_pair(pars); pars = pair_tail(pars))
+    if (pair_head(pars) == symbol)
+      return TRUE;
+  return FALSE;
+}
+
+// Returns the number of nodes in `form', or -1 if it can not be the body of an
+// inlined function. It may only reference the parameters as variables, and
+// call the global functions not shadowed at the call site.
+int inline_size(lt *form, lt *pars, lt *env) {
+  if (is_lt_symbol(form))
+    return is_parameter(form, pars)? 1: -1;
+  if (!is_lt_pair(form) || is_quote_form(form))
+    return 1;
+  lt *op = pair_head(form);
+  if (is_if_form(form)) {
+    int len = pair_length(form);
+    if (!(3 <= len && len <= 4))
+      return -1;
+  } else if (!is_lt_symbol(op) ||
+      is_parameter(op, pars) ||
+      form_type(form) != NOT_SPECIAL_FORM ||
+      is_macro_form(form) ||
+      is_var_in_env(op, env) != NULL)
+    return -1;
+  int size = 1;
+  lt *args = pair_tail(form);
+  for (; is_lt_pair(args); args = pair_tail(args)) {
+    int n = inline_size(pair_head(args), pars, env);
+    if (n < 0)
+      return -1;
+    size += n;
+    if (size > INLINE_MAX_SIZE)
+      return -1;
+  }
+  return isnull(args)? size: -1;
+}
+
+// Returns the function to be inlined for the call, or NULL if it is called.
+// Only the functions created by a lambda at top-level have their bodies.
+lt *inlined_function(lt *proc, lt *args, lt *env) {
+  if (!is_inline || inline_depth >= INLINE_MAX_DEPTH || !is_global_fun_name(proc, env))
+    return NULL;
+  lt *fn = symbol_value(proc);
+  if (!is_lt_function(fn) || function_body(fn) == the_undef)
+    return NULL;
+  lt *body = function_body(fn);
+  if (function_restp(fn) ||
+      function_nrequired(fn) != pair_length(args) ||
+      !is_lt_pair(body) ||
+      !isnull(pair_tail(body)))
+    return NULL;
+  return inline_size(pair_head(body), function_args(fn), env) < 0? NULL: fn;
+}
+
+// Returns the variable bound to `symbol' in the function being compiled, or
+// NULL if it is free in the function or global
+lt *local_variable(lt *symbol, lt *env) {
+  for (; !isnull_env(env) && !is_closure_frame(env); env = environment_next(env)) {
+    lt *j = is_var_in_frame(symbol, environment_bindings(env));
+    if (j != NULL)
+      return lt_raw_nth(environment_bindings(env), fixnum_value(j));
+  }
+  return NULL;
+}
+
+// Whether the argument keeps its value while the body of the inlined function
+// is evaluated, so that it can replace the parameter. The functions called by
+// the body may assign a global variable, or a local one through a closure, so
+// only the constants and the local variables not assigned or captured so far
+// are.
+int is_trivial_argument(lt *arg, lt *env) {
+  if (is_lt_symbol(arg)) {
+    lt *var = local_variable(arg, env);
+    return var != NULL &&
+        variable_is_assigned(var) != the_true &&
+        variable_is_captured(var) != the_true;
+  }
+  return !is_lt_pair(arg) || is_quote_form(arg);
+}
+
+lt *substitute_parameters(lt *form, lt *pars, lt *args) {
+  if (is_lt_symbol(form)) {
+    for (; is_lt_pair(pars); pars = pair_tail(pars), args = pair_tail(args))
+      if (pair_head(pars) == form)
+        return pair_head(args);
+    return form;
+  }
+  if (!is_lt_pair(form) || is_quote_form(form))
+    return form;
+  lt *result = the_empty_list;
+  for (; is_lt_pair(form); form = pair_tail(form))
+    result = make_pair(substitute_parameters(pair_head(form), pars, args), result);
+  return lt_list_nreverse(result);
+}
+
+// The parameters in the body are replaced by the arguments if they are all
+// trivial. Otherwise the arguments are bound to the parameters by a let form,
+// which keeps the order of evaluation.
+lt *inline_call(lt *fn, lt *args, lt *env) {
+  lt *pars = function_args(fn);
+  lt *body = pair_head(function_body(fn));
+  lt *bindings = the_empty_list;
+  int is_trivial = TRUE;
+  for (lt *as = args, *ps = pars; is_lt_pair(as); as = pair_tail(as), ps = pair_tail(ps)) {
+    is_trivial = is_trivial && is_trivial_argument(pair_head(as), env);
+    bindings = make_pair(list2(pair_head(ps), pair_head(as)), bindings);
+  }
+  if (is_trivial)
+    return substitute_parameters(body, pars, args);
+  return list3(S("let"), lt_list_nreverse(bindings), body);
+}
+
+void add_dependent(lt *name, lt *globals) {
+  for (; is_lt_pair(globals); globals = pair_tail(globals)) {
+    lt *global = pair_head(globals);
+    if (!is_parameter(name, symbol_dependents(global)))
+      symbol_dependents(global) = make_pair(name, symbol_dependents(global));
+  }
+}
+
+// Compiles a lambda assigned to a global variable at top-level. The variable
+// is recorded as a dependent of the functions inlined into it, including the
+// ones inlined into them, so that it is compiled again when they are redefined.
+void compile_definition(lt *name, lt *lambda, emitter_t *e) {
+  lt *saved = inlined_globals;
+  inlined_globals = the_empty_list;
+  compile_object(lambda, null_env, FALSE, e);
+  add_dependent(name, inlined_globals);
+  inlined_globals = saved;
+}
+
+void recompile_function(lt *name) {
+  lt *fn = symbol_value(name);
+  if (!is_lt_function(fn) || function_body(fn) == the_undef)
+    return;
+  lt *saved = inlined_globals;
+  int depth = inline_depth;
+  inlined_globals = the_empty_list;
+  inline_depth = 0;
+  emitter_t *e = make_emitter();
+  lt *proto = compile_lambda(function_args(fn), function_body(fn), null_env, e);
+  add_dependent(name, inlined_globals);
+  inlined_globals = saved;
+  inline_depth = depth;
+  if (e->error != NULL)
+    return;
+//  A top-level function captures nothing, so the prototype is used as the closure
+  function_code(proto) = assemble_code(function_code(proto), function_frame_size(proto));
+  function_name(proto) = function_name(fn);
+  symbol_value(name) = proto;
+}
+
+// Compiles again the functions into which `symbol' was inlined, after it is
+// assigned. They record themselves again if it is still inlined.
+void invalidate_dependents(lt *symbol) {
+  lt *names = symbol_dependents(symbol);
+  symbol_dependents(symbol) = the_empty_list;
+  for (; is_lt_pair(names); names = pair_tail(names))
+    recompile_function(pair_head(names));
+}
+
+// A function named by a global variable is loaded by the instruction with an
+// inline cache specific to the kind of call.
+void compile_app(lt *proc, lt *args, lt *env, int is_tail, emitter_t *e) {
+  lt *fn = inlined_function(proc, args, env);
+  if (fn != NULL) {
+    if (inlined_globals != NULL)
+      inlined_globals = make_pair(proc, inlined_globals);
+    inline_depth++;
+    compile_object(inline_call(fn, args, env), env, is_tail, e);
+    inline_depth--;
+    return;
+  }
   lt *nargs = make_fixnum(pair_length(args));
-  lt *op = compile_object(proc, env);
-  args = compile_args(args, env);
-  if (is_signaled(args))
-    return args;
+  int is_global = is_global_fun_name(proc, env);
+  int depth = e->depth;
+  compile_args(args, env, e);
+  if (is_inline_op(proc, nargs, env)) {
+    e->depth = depth;
+    emit(e, make_fn_inst(proc));
+    emit(e, gen_count(is_tail));
+    return;
+  }
   if (is_primitive_fun_name(proc, env)) {
+    e->depth = depth;
     lt *prim = symbol_value(proc);
-    if (isopcode_fn(proc))
-      return seq(args,
-          compile_type_check(prim, nargs),
-          make_fn_inst(proc),
-          compile_checkex(),
-          gen(CUTSTACK));
-    else
-      return seq(args,
-          compile_type_check(prim, nargs),
-          op,
-          gen(PRIM, nargs),
-          compile_checkex(),
-          gen(CUTSTACK));
+    emit(e, compile_type_check(prim, nargs));
+    emit(e, gen(GPRIM, proc));
+    emit(e, gen(PRIM, nargs));
+    emit(e, gen_count(is_tail));
+    return;
+  }
+  if (is_tail != MV_CONTEXT && is_global)
+    emit(e, gen(is_tail? GTCALL: GCALL, proc));
+  else
+    compile_object(proc, env, FALSE, e);
+  e->depth = depth;
+  if (is_tail == MV_CONTEXT)
+//    The callee leaves all of its values and their count on the stack
+    emit(e, gen(MVCALL, nargs));
+  else if (is_tail) {
+//    The callee reuses the frame of the current function and returns to its
+//    caller directly. The RETURN is only reached when `op' evaluates to a
+//    primitive function at run-time.
+    emit(e, gen(TCALL, nargs));
+    emit(e, gen(RETURN));
   } else
-    return seq(args,
-        op,
-        gen(CALL, nargs),
-        compile_checkex(),
-        gen(CUTSTACK));
+    emit(e, gen(CALL, nargs));
 }
 
-lt *compile_mvlist(lt *arg, lt *env) {
-  arg = compile_object(arg, env);
-  return seq(gen(SETMV),
-      arg,
-      gen(MVLIST));
+// When an exception is raised within the form, the VM unwinds to the label and
+// the exception becomes the value of the `catch' form.
+void compile_catch(lt *form, lt *env, emitter_t *e) {
+  lt *handler = make_label();
+  emit(e, gen(CATCH, handler));
+  compile_object(form, env, FALSE, e);
+  emit(e, list1(handler));
 }
 
-lt *compile_return(lt *value, lt *env) {
-  value = compile_object(value, env);
-  return seq(value, gen(RETURN));
+void compile_mvlist(lt *arg, lt *env, emitter_t *e) {
+  lt *start = make_label();
+  emit(e, list1(start));
+  compile_object(arg, env, MV_CONTEXT, e);
+  emit(e, gen(MVLIST, start));
 }
 
-lt *compile_values(lt *args, lt *env) {
+// The values are bound to the variables without being collected into a list
+void compile_mvbind(lt *form, lt *env, int is_tail, emitter_t *e) {
+  lt *vars = second(form);
+  lt *count = make_fixnum(pair_length(vars));
+  lt *start = make_label();
+  emit(e, list1(start));
+  compile_object(third(form), env, MV_CONTEXT, e);
+  emit(e, gen(MVBIND, count, start));
+  env = make_frame(vars, env);
+  e->depth += fixnum_value(count);
+  compile_scope(env, pair_tail(pair_tail(pair_tail(form))), is_tail, e);
+  e->depth -= fixnum_value(count);
+}
+
+void compile_return(lt *value, lt *env, emitter_t *e) {
+  compile_object(value, env, FALSE, e);
+  emit(e, gen(RETURN));
+}
+
+// In tail position the values are returned by VALUES, which leaves only the
+// first one if the caller does not want all of them. Elsewhere the number of
+// values wanted is known at compile-time.
+void compile_values(lt *args, lt *env, int is_tail, emitter_t *e) {
   assert(isnull(args) || is_lt_pair(args));
   assert(is_lt_environment(env));
-  int len = 0;
-  lt *is = make_empty_list();
-  while (is_lt_pair(args)) {
-    lt *arg = pair_head(args);
-    arg = compile_object(arg, env);
-    pair_tail(arg) = is;
-    is = arg;
-    args = pair_tail(args);
-    len++;
+  lt *len = make_fixnum(pair_length(args));
+  int depth = e->depth;
+  for (lt *as = args; is_lt_pair(as); as = pair_tail(as)) {
+    compile_object(pair_head(as), env, FALSE, e);
+    if (is_tail == FALSE && as != args)
+      emit(e, gen(POP));
+    else
+      e->depth++;
   }
-  is = lt_list_nreverse(is);
-  return seq(is,
-      gen(VALUES, make_fixnum(len)),
-      gen(RETURN));
-}
-
-lt *compile_let_bindings(lt *vals, lt *env) {
-  return compile_args(vals, env);
+  e->depth = depth;
+  if (is_tail == MV_CONTEXT)
+    emit(e, gen(CONST, len));
+  else if (is_tail)
+    emit(e, gen(VALUES, len));
+  else if (isnull(args))
+    emit(e, gen(CONST, the_empty_list));
 }
 
-lt *compile_let(lt *form, lt *env) {
+void compile_let(lt *form, lt *env, int is_tail, emitter_t *e) {
   lt *bindings = let_bindings(form);
-  lt *body = let_body(form);
   lt *vars = let_vars(bindings);
-  lt *vals = let_vals(bindings);
-  lt *count = make_fixnum(pair_length(vars));
-  env = make_environment(vars, env);
-  return seq(gen(EXTENV, count),
-      compile_let_bindings(vals, env),
-      gen(MOVEARGS, count),
-      compile_begin(body, env),
-      gen(POPENV));
-}
-
-lisp_object_t *compile_object(lisp_object_t *object, lisp_object_t *env) {
-  if (is_lt_symbol(object))
-    return gen_var(object, env);
-  if (!is_lt_pair(object))
-    return gen(CONST, object);
-  if (is_macro_form(object))
-    return compile_object(lt_expand_macro(object), env);
-  if (is_let_form(object))
-    return compile_let(object, env);
-  if (is_quote_form(object)) {
-    if (pair_length(object) != 2)
-      return compiler_error("There must and be only one argument of a quote form");
-    return gen(CONST, second(object));
-  }
-  if (is_begin_form(object))
-    return compile_begin(pair_tail(object), env);
-  if (is_set_form(object)) {
-    if (pair_length(object) != 3)
-      return compiler_error("There must and be only two arguments of a set! form");
-    if (!is_lt_symbol(second(object)))
-      return compiler_error("The variable as the first variable must be of type symbol");
-    lisp_object_t *value = compile_object(third(object), env);
-    lisp_object_t *set = gen_set(second(object), env);
-    return seq(value, set);
-  }
-  if (is_if_form(object)) {
-    int len = pair_length(object);
-    if (!(3 <= len && len <= 4))
-      return compiler_error("The number of arguments of a if form must between 3 and 4");
-    lisp_object_t *pred = second(object);
-    lisp_object_t *then = third(object);
-    lisp_object_t *else_part = fourth(object);
-    return compile_if(pred, then, else_part, env);
-  }
-  if (is_lambda_form(object))
-    return gen(FN, compile_lambda(second(object), pair_tail(pair_tail(object)), env));
-  if (is_mvl_form(object))
-    return compile_mvlist(second(object), env);
-  if (is_catch_form(object))
-    return gen(CATCH);
-  if (is_goto_form(object))
-    return gen(JUMP, second(object));
-  if (is_return_form(object))
-    return compile_return(second(object), env);
-  if (is_tagbody_form(object)) {
-    return compile_tagbody(pair_tail(object), env);
-  }
-  if (is_values_form(object)) {
-    return compile_values(pair_tail(object), env);
-  }
-  if (is_lt_pair(object)) {
-    lt *args = pair_tail(object);
-    lisp_object_t *fn = pair_head(object);
-    return compile_app(fn, args, env);
-  }
-  writef(standard_out, "Impossible --- Unable to compile %?\n", object);
-  exit(1);
+  int depth = e->depth;
+  compile_args(let_vals(bindings), env, e);
+  env = make_frame(vars, env);
+  compile_scope(env, let_body(form), is_tail, e);
+  e->depth = depth;
+}
+
+// These forms have exactly one value, so the count is pushed after it in
+// MV_CONTEXT. The values of the other ones are pushed by their subforms.
+int is_single_value_form(lt *object) {
+  return !is_lt_pair(object) ||
+      is_catch_form(object) ||
+      is_goto_form(object) ||
+      is_lambda_form(object) ||
+      is_mvl_form(object) ||
+      is_quote_form(object) ||
+      is_return_form(object) ||
+      is_set_form(object) ||
+      is_tagbody_form(object);
+}
+
+// `is_tail' indicates whether the object is in tail position of a function body,
+// or is MV_CONTEXT. The instructions are emitted to `e'.
+void compile_object(lisp_object_t *object, lisp_object_t *env, int is_tail, emitter_t *e) {
+  if (e->error != NULL)
+    return;
+  if (is_tail == MV_CONTEXT && is_single_value_form(object)) {
+    compile_object(object, env, FALSE, e);
+    emit(e, gen_count(MV_CONTEXT));
+    return;
+  }
+  if (is_lt_symbol(object)) {
+    emit(e, gen_var(object, env));
+    return;
+  }
+  if (!is_lt_pair(object)) {
+    emit(e, gen(CONST, object));
+    return;
+  }
+  if (is_macro_form(object)) {
+    compile_object(lt_expand_macro(object), env, is_tail, e);
+    return;
+  }
+  switch (form_type(object)) {
+    case BEGIN_FORM:
+      compile_begin(pair_tail(object), env, is_tail, e);
+      break;
+    case CATCH_FORM:
+      if (pair_length(object) != 2)
+        emit_error(e, "There must and be only one argument of a catch form");
+      else
+        compile_catch(second(object), env, e);
+      break;
+    case GOTO_FORM:
+      compile_goto(second(object), e);
+      break;
+    case IF_FORM: {
+      int len = pair_length(object);
+      if (!(3 <= len && len <= 4))
+        emit_error(e, "The number of arguments of a if form must between 3 and 4");
+      else
+        compile_if(second(object), third(object), fourth(object), env, is_tail, e);
+    }
+      break;
+    case LAMBDA_FORM:
+      emit(e, gen(FN, compile_lambda(second(object), pair_tail(pair_tail(object)), env, e)));
+      break;
+    case LET_FORM:
+      compile_let(object, env, is_tail, e);
+      break;
+    case MVBIND_FORM:
+      if (pair_length(object) < 3)
+        emit_error(e, "There must be at least two arguments of a multiple-value-bind form");
+      else if (!is_symbol_list(second(object)))
+        emit_error(e, "The variables of a multiple-value-bind form must be a list of symbols");
+      else
+        compile_mvbind(object, env, is_tail, e);
+      break;
+    case MVL_FORM:
+      compile_mvlist(second(object), env, e);
+      break;
+    case QUOTE_FORM:
+      if (pair_length(object) != 2)
+        emit_error(e, "There must and be only one argument of a quote form");
+      else
+        emit(e, gen(CONST, second(object)));
+      break;
+    case RETURN_FORM:
+      compile_return(second(object), env, e);
+      break;
+    case SET_FORM:
+      if (pair_length(object) != 3)
+        emit_error(e, "There must and be only two arguments of a set! form");
+      else if (!is_lt_symbol(second(object)))
+        emit_error(e, "The variable as the first variable must be of type symbol");
+      else {
+        if (is_inline && isnull_env(env) && is_lambda_form(third(object)))
+          compile_definition(second(object), third(object), e);
+        else
+          compile_object(third(object), env, FALSE, e);
+        emit(e, gen_set(second(object), env));
+      }
+      break;
+    case TAGBODY_FORM:
+      compile_tagbody(pair_tail(object), env, e);
+      break;
+    case VALUES_FORM:
+      compile_values(pair_tail(object), env, is_tail, e);
+      break;
+    case NOT_SPECIAL_FORM:
+      compile_app(pair_head(object), pair_tail(object), env, is_tail, e);
+      break;
+  }
 }
 
 lt *compile_to_bytecode(lt *form) {
-  lt *x = compile_object(form, null_env);
-  if (is_signaled(x))
-    return x;
+  emitter_t *e = make_emitter();
+  compile_object(form, null_env, FALSE, e);
+  if (e->error != NULL)
+    return e->error;
   else
-    return assemble(x);
+    return assemble(e->code);
 }
@@ -11,8 +11,8 @@
 #include "type.h"
 
 extern lt *assemble(lt *);
-extern lt *compile_object(lt *, lt *);
 extern lt *compile_to_bytecode(lt *);
-extern lt *gen(enum TYPE, ...);
+extern lt *gen(enum OPCODE_TYPE, ...);
+extern void invalidate_dependents(lt *);
 
 #endif /* COMPILER_H_ */
@@ -14,75 +14,133 @@
 #include "hash_table.h"
 #include "type.h"
 
-ht_slot_t *make_slot(void *key, void *value, ht_slot_t *next) {
-  ht_slot_t *sl = GC_MALLOC(sizeof(*sl));
-  sl_key(sl) = key;
-  sl_value(sl) = value;
-  sl_next(sl) = next;
-  return sl;
+// The address of this variable marks the removed entries
+char ht_removed_key;
+
+ht_entry_t *make_entries(int capacity) {
+  return GC_MALLOC(capacity * sizeof(ht_entry_t));
 }
 
+// The capacity is rounded up to a power of two, so that the index of a hash
+// value is computed by masking instead of division.
 hash_table_t *make_hash_table(int length, hash_fn_t hash_fn, comp_fn_t comp_fn) {
+  int capacity = 8;
+  while (capacity < length)
+    capacity *= 2;
   hash_table_t *ht = GC_MALLOC(sizeof(hash_table_t));
-  ht_slots(ht) = GC_MALLOC(length * sizeof(ht_slot_t *));
-  ht_length(ht) = length;
+  ht_entries(ht) = make_entries(capacity);
+  ht_capacity(ht) = capacity;
+  ht_count(ht) = 0;
+  ht_used(ht) = 0;
   ht_hash_fn(ht) = hash_fn;
   ht_comp_fn(ht) = comp_fn;
   return ht;
 }
 
-unsigned int compute_index(void *key, hash_table_t *ht) {
-  hash_fn_t fn = ht_hash_fn(ht);
-  int length = ht_length(ht);
-  return (*fn)(key) % length;
-}
-
 int compare_in_ht(void *k1, void *k2, hash_table_t *ht) {
   comp_fn_t fn = ht_comp_fn(ht);
   return (*fn)(k1, k2);
 }
 
-ht_slot_t *raw_search_ht(void *key, hash_table_t *ht) {
-  int index = compute_index(key, ht);
-  ht_slot_t *sl = ht_slots(ht)[index];
-  while (sl != NULL) {
-    void *sk = sl_key(sl);
-    if (compare_in_ht(sk, key, ht) == 0)
-      return sl;
-    sl = sl_next(sl);
+// Returns the entry of `key', or the empty one where it would be added
+ht_entry_t *raw_search_ht(void *key, unsigned int hash, hash_table_t *ht) {
+  unsigned int mask = ht_capacity(ht) - 1;
+  ht_entry_t *removed = NULL;
+  for (unsigned int i = hash & mask; ; i = (i + 1) & mask) {
+    ht_entry_t *en = &ht_entries(ht)[i];
+    if (en_key(en) == NULL)
+      return removed != NULL? removed: en;
+    if (en_key(en) == HT_REMOVED) {
+      if (removed == NULL)
+        removed = en;
+    } else if (en_hash(en) == hash && compare_in_ht(en_key(en), key, ht) == 0)
+      return en;
+  }
+}
+
+// Moves the keys into a new array of entries, which drops the removed ones. The
+// array is doubled only when the keys alone fill up half of it.
+void resize_ht(hash_table_t *ht) {
+  ht_entry_t *entries = ht_entries(ht);
+  int capacity = ht_capacity(ht);
+  int new_capacity = capacity;
+  while ((ht_count(ht) + 1) * 2 > new_capacity)
+    new_capacity *= 2;
+  ht_entries(ht) = make_entries(new_capacity);
+  ht_capacity(ht) = new_capacity;
+  ht_used(ht) = ht_count(ht);
+  unsigned int mask = new_capacity - 1;
+  for (int i = 0; i < capacity; i++) {
+    ht_entry_t *en = &entries[i];
+    if (en_key(en) == NULL || en_key(en) == HT_REMOVED)
+      continue;
+    unsigned int j = en_hash(en) & mask;
+    while (en_key(&ht_entries(ht)[j]) != NULL)
+      j = (j + 1) & mask;
+    ht_entries(ht)[j] = *en;
   }
-  return NULL;
 }
 
 void *search_ht(void *key, hash_table_t *ht) {
-  ht_slot_t *sl = raw_search_ht(key, ht);
-  if (sl != NULL)
-    return sl_value(sl);
+  ht_entry_t *en = raw_search_ht(key, (*ht_hash_fn(ht))(key), ht);
+  if (en_key(en) != NULL && en_key(en) != HT_REMOVED)
+    return en_value(en);
   else
     return NULL;
 }
 
 void set_ht(void *key, void *value, hash_table_t *ht) {
-  ht_slot_t *sl = raw_search_ht(key, ht);
-  if (sl != NULL)
-    sl_value(sl) = value;
-  else {
-    unsigned int index = compute_index(key, ht);
-    ht_slot_t *org = ht_slots(ht)[index];
-    ht_slot_t *sl = make_slot(key, value, org);
-    ht_slots(ht)[index] = sl;
+  unsigned int hash = (*ht_hash_fn(ht))(key);
+  ht_entry_t *en = raw_search_ht(key, hash, ht);
+  if (en_key(en) != NULL && en_key(en) != HT_REMOVED) {
+    en_value(en) = value;
+    return;
+  }
+//  The table is kept at most three quarters used, so that probing ends soon
+  if (en_key(en) == NULL && (ht_used(ht) + 1) * 4 > ht_capacity(ht) * 3) {
+    resize_ht(ht);
+    en = raw_search_ht(key, hash, ht);
+  }
+  if (en_key(en) == NULL)
+    ht_used(ht)++;
+  en_key(en) = key;
+  en_value(en) = value;
+  en_hash(en) = hash;
+  ht_count(ht)++;
+}
+
+// Returns whether the key was in the table
+int remove_ht(void *key, hash_table_t *ht) {
+  ht_entry_t *en = raw_search_ht(key, (*ht_hash_fn(ht))(key), ht);
+  if (en_key(en) == NULL || en_key(en) == HT_REMOVED)
+    return FALSE;
+  en_key(en) = HT_REMOVED;
+  en_value(en) = NULL;
+  ht_count(ht)--;
+  return TRUE;
+}
+
+// Returns the index of the first entry holding a key after the index `i', or -1
+// if there is none. The iteration starts from -1.
+int ht_next_entry(hash_table_t *ht, int i) {
+  for (i++; i < ht_capacity(ht); i++) {
+    void *key = en_key(&ht_entries(ht)[i]);
+    if (key != NULL && key != HT_REMOVED)
+      return i;
   }
+  return -1;
 }
 
+// The FNV-1a hash function, which mixes every byte into all the bits
 unsigned int string_hash_fn(void *string) {
-  char *name = (char *)string;
-  int seed = 131;
-  unsigned int hash = 0;
+  unsigned char *name = (unsigned char *)string;
+  unsigned int hash = 2166136261u;
   while (*name != '\0') {
-    hash = hash * seed + *name;
+    hash ^= *name;
+    hash *= 16777619u;
     name++;
   }
-  return hash & 0x7FFFFFFF;
+  return hash;
 }
 
 int string_comp_fn(void *s1, void *s2) {
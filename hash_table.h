@@ -10,40 +10,53 @@
 
 typedef unsigned int (*hash_fn_t)(void *);
 typedef int (*comp_fn_t)(void *, void *);
-typedef struct ht_slot_t ht_slot_t;
+typedef struct ht_entry_t ht_entry_t;
 typedef struct hash_table_t hash_table_t;
 
 /* General Hash Table Definition */
-struct ht_slot_t {
+// An entry whose key is NULL has never been used, and one whose key is
+// HT_REMOVED has been removed, which does not stop the probing for a key.
+// hash: The hash value of the key, compared before calling the comparator
+struct ht_entry_t {
   void *key;
   void *value;
-  ht_slot_t *next;
+  unsigned int hash;
 };
 
-// slots: An array for storing key-values
-// length: Length of slots
-// hash_fn: Pointer to function for generating hash value used as index in slots
+// entries: An array for storing key-values, probed linearly from the index
+//          given by the hash value of a key
+// capacity: Length of entries, which is a power of two
+// count: The number of keys in the table
+// used: The number of entries not empty, including the removed ones
+// hash_fn: Pointer to function for generating hash value used as index in entries
 // comp_fn: Pointer to function for comparing two keys when their hash value is equal
 struct hash_table_t {
-  ht_slot_t **slots;
-  int length;
+  ht_entry_t *entries;
+  int capacity, count, used;
   hash_fn_t hash_fn;
   comp_fn_t comp_fn;
 };
 
+extern char ht_removed_key;
+#define HT_REMOVED ((void *)&ht_removed_key)
+
 extern hash_table_t *make_hash_table(int, hash_fn_t, comp_fn_t);
 extern void *search_ht(void *, hash_table_t *);
 extern void set_ht(void *, void *, hash_table_t *);
+extern int remove_ht(void *, hash_table_t *);
+extern int ht_next_entry(hash_table_t *, int);
 
 extern unsigned int string_hash_fn(void *);
 extern int string_comp_fn(void *, void *);
 
 /* Hash Table */
-#define sl_key(x) ((x)->key)
-#define sl_value(x) ((x)->value)
-#define sl_next(x) ((x)->next)
-#define ht_slots(x) ((x)->slots)
-#define ht_length(x) ((x)->length)
+#define en_key(x) ((x)->key)
+#define en_value(x) ((x)->value)
+#define en_hash(x) ((x)->hash)
+#define ht_entries(x) ((x)->entries)
+#define ht_capacity(x) ((x)->capacity)
+#define ht_count(x) ((x)->count)
+#define ht_used(x) ((x)->used)
 #define ht_hash_fn(x) ((x)->hash_fn)
 #define ht_comp_fn(x) ((x)->comp_fn)
 
@@ -35,10 +35,13 @@ void init_structures(void) {
 }
 
 void init_global_variable(void) {
+//  GMP allocates through the GC, which must be set before any number is made
+  mp_set_memory_functions(gmp_allocate, gmp_reallocate, gmp_free);
   /* Initialize global variables */
   debug = FALSE;
   is_check_exception = TRUE;
   is_check_type = TRUE;
+  is_inline = FALSE;
 
   the_argv = make_vector(0);
   the_false = make_false();
@@ -84,6 +87,20 @@ void init_global_variable(void) {
   the_splicing_symbol = LISP("unquote-splicing");
   the_tagbody_symbol = LISP("tagbody");
   the_unquote_symbol = LISP("unquote");
+  /* Special forms initialization */
+  symbol_form(LISP("begin")) = BEGIN_FORM;
+  symbol_form(LISP("catch")) = CATCH_FORM;
+  symbol_form(LISP("goto")) = GOTO_FORM;
+  symbol_form(LISP("if")) = IF_FORM;
+  symbol_form(LISP("lambda")) = LAMBDA_FORM;
+  symbol_form(LISP("let")) = LET_FORM;
+  symbol_form(LISP("multiple-value-bind")) = MVBIND_FORM;
+  symbol_form(LISP("multiple-value-list")) = MVL_FORM;
+  symbol_form(LISP("quote")) = QUOTE_FORM;
+  symbol_form(LISP("return")) = RETURN_FORM;
+  symbol_form(LISP("set!")) = SET_FORM;
+  symbol_form(LISP("tagbody")) = TAGBODY_FORM;
+  symbol_form(LISP("values")) = VALUES_FORM;
   /* Exception tags initialization */
   the_compiler_error_symbol = LISP("compiler-error");
   the_error_symbol = LISP("error");
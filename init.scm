@@ -61,6 +61,9 @@
 (define eof? (x)
   (is-type? x 'teof))
 
+(define exception? (x)
+  (is-type? x 'exception))
+
 (define fixnum? (x)
   (is-type? x 'fixnum))
 
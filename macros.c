@@ -160,9 +160,10 @@ lt *make_single_let(lt *var, lt *val, lt *action) {
   return make_pair(LISP("let"), make_pair(bindings, action));
 }
 
+// The exception is thrown again if none of handlers matches
 lt *handler2if(lt *ex, lt *handlers) {
   if (isnull(handlers))
-    return ex;
+    return list2(LISP("throw"), ex);
   else {
     lt *handler = pair_head(handlers);
     lt *rest = pair_tail(handlers);
@@ -175,10 +176,9 @@ lt *handler2if(lt *ex, lt *handlers) {
 lt *try_catch_macro(lt *form, lt *handlers) {
   lt *tmp = lt_gensym();
   lt *handler_forms = handler2if(tmp, handlers);
-  lt *bd = list2(tmp, form);
-  lt *catch = list1(the_catch_symbol);
-  lt *lf = make_pair(LISP("let"), list2(list1(bd), handler_forms));
-  return list3(the_begin_symbol, catch, lf);
+  lt *test = list4(LISP("if"), list2(LISP("exception?"), tmp), handler_forms, tmp);
+  lt *bd = list2(tmp, list2(the_catch_symbol, form));
+  return list3(LISP("let"), list1(bd), test);
 }
 
 void init_macros(void) {
@@ -10,6 +10,7 @@
  */
 #include <assert.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,6 +26,7 @@
 int debug;
 int is_check_exception;
 int is_check_type;
+int is_inline;
 char tbl[256];
 lt *gensym_counter;
 lt *null_env;
@@ -83,11 +85,14 @@ struct lisp_object_t lt_types[] = {
     DEFTYPE(LT_TCLOSE, "tclose"),
     DEFTYPE(LT_TEOF, "teof"),
     DEFTYPE(LT_TUNDEF, "tundef"),
+    DEFTYPE(LT_UNICODE, "unicode"),
     DEFTYPE(LT_BIGNUM, "bignum"),
+    DEFTYPE(LT_CODE, "code"),
     DEFTYPE(LT_ENVIRONMENT, "environment"),
     DEFTYPE(LT_EXCEPTION, "exception"),
     DEFTYPE(LT_FUNCTION, "function"),
     DEFTYPE(LT_FLOAT, "float"),
+    DEFTYPE(LT_HASH_TABLE, "hash-table"),
     DEFTYPE(LT_INPUT_PORT, "input-file"),
     DEFTYPE(LT_MPFLONUM, "mpflonum"),
     DEFTYPE(LT_OPCODE, "opcode"),
@@ -95,45 +100,88 @@ struct lisp_object_t lt_types[] = {
     DEFTYPE(LT_PACKAGE, "package"),
     DEFTYPE(LT_PAIR, "pair"),
     DEFTYPE(LT_PRIMITIVE, "primitive"),
-    DEFTYPE(LT_RETADDR, "retaddr"),
     DEFTYPE(LT_STRING, "string"),
     DEFTYPE(LT_STRUCT, "structure"),
     DEFTYPE(LT_SYMBOL, "symbol"),
     DEFTYPE(LT_TIME, "time"),
     DEFTYPE(LT_TYPE, "type"),
-    DEFTYPE(LT_UNICODE, "unicode"),
     DEFTYPE(LT_VECTOR, "vector"),
 };
 
-#define DEFCODE(name, arity) {.type=LT_OPCODE, .u={.opcode={name, arity, #name, NULL}}}
+// The format of an opcode describes the kinds of its operands in the compact
+// instruction stream: `i' is an integer, `c' is an index into the constant pool
+// and `l' is the address of the instruction to jump to. `v' is the stack slot
+// of a local variable. `k' is a word of inline cache, which takes no operand of
+// the opcode and is filled in at run-time.
+#define DEFCODE(name, format) {.type=LT_OPCODE, .u={.opcode={name, sizeof(format) - 1, #name, NULL, format}}}
 
 struct lisp_object_t lt_codes[] = {
-    DEFCODE(CALL, 1),
-    DEFCODE(CATCH, 0),
-    DEFCODE(CHECKEX, 0),
-    DEFCODE(CHKARITY, 1),
-    DEFCODE(CHKTYPE, 3),
-    DEFCODE(CONST, 1),
-    DEFCODE(CUTSTACK, 0),
-    DEFCODE(EXTENV, 1),
-    DEFCODE(FN, 1),
-    DEFCODE(GSET, 1),
-    DEFCODE(GVAR, 1),
-    DEFCODE(FJUMP, 1),
-    DEFCODE(JUMP, 1),
-    DEFCODE(LSET, 2),
-    DEFCODE(LVAR, 2),
-    DEFCODE(MOVEARGS, 1),
-    DEFCODE(MVLIST, 0),
-    DEFCODE(POP, 0),
-    DEFCODE(POPENV, 0),
-    DEFCODE(PRIM, 1),
-    DEFCODE(RESTARGS, 1),
-    DEFCODE(RETURN, 0),
-    DEFCODE(SETMV, 0),
-    DEFCODE(VALUES, 1),
-//    Opcodes for some primitive functions
-    DEFCODE(CONS, 0),
+//    The variants of CSET, CVAR, LSET and LVAR for the variables shared through
+//    a box. They are chosen by the assembler instead of being generated.
+    DEFCODE(BCSET, "i"),
+    DEFCODE(BCVAR, "i"),
+    DEFCODE(BLSET, "v"),
+    DEFCODE(BLVAR, "v"),
+    DEFCODE(BOX, "v"),
+    DEFCODE(CALL, "i"),
+//    Marks the beginning of a region protected by a handler, which is recorded in
+//    the handler table of the code instead of being emitted into the stream.
+    DEFCODE(CATCH, ""),
+    DEFCODE(CHKTYPE, "iii"),
+    DEFCODE(CONST, "c"),
+    DEFCODE(CSET, "i"),
+    DEFCODE(CVAR, "i"),
+    DEFCODE(FN, "c"),
+//    GCALL, GPRIM and GTCALL load a global function like GVAR, which is then called
+//    by the following CALL, PRIM or TCALL respectively. The callee is cached so
+//    that the checks of the call are skipped when the variable is unchanged.
+    DEFCODE(GCALL, "ck"),
+    DEFCODE(GPRIM, "ck"),
+    DEFCODE(GSET, "c"),
+    DEFCODE(GTCALL, "ck"),
+    DEFCODE(GVAR, "c"),
+    DEFCODE(FJUMP, "l"),
+    DEFCODE(HALT, ""),
+    DEFCODE(JUMP, "l"),
+//    Marks the values on the top of stack as the slots of the local variables,
+//    which are numbered by the assembler from the depth of stack.
+    DEFCODE(LOCALS, ""),
+    DEFCODE(LSET, "v"),
+    DEFCODE(LVAR, "v"),
+//    The label operands of MVBIND and MVLIST mark where the evaluation of the
+//    values begins, and are only used for computing the depth of stack.
+    DEFCODE(MVBIND, "i"),
+    DEFCODE(MVCALL, "i"),
+    DEFCODE(MVLIST, ""),
+    DEFCODE(MVSLIDE, "i"),
+    DEFCODE(POP, ""),
+    DEFCODE(PRIM, "i"),
+    DEFCODE(RETURN, ""),
+    DEFCODE(SLIDE, "i"),
+    DEFCODE(TCALL, "i"),
+    DEFCODE(VALUES, "i"),
+//    Opcodes for some primitive functions. The function of the global variable is
+//    cached when compiling, and is called instead when the variable is changed.
+    DEFCODE(CONS, "ck"),
+    DEFCODE(EQ, "ck"),
+    DEFCODE(ADD, "ck"),
+    DEFCODE(SUB, "ck"),
+    DEFCODE(MUL, "ck"),
+    DEFCODE(NUMEQ, "ck"),
+    DEFCODE(GT, "ck"),
+    DEFCODE(LT, "ck"),
+//    A superinstruction takes the place of the first instruction of a pair, with
+//    the same operands. The second one is kept in the stream and executed
+//    without being dispatched.
+    DEFCODE(CONST_GPRIM, "c"),
+    DEFCODE(FJUMP_LVAR, "l"),
+    DEFCODE(GT_FJUMP, "ck"),
+    DEFCODE(LT_FJUMP, "ck"),
+    DEFCODE(LVAR_CONST, "v"),
+    DEFCODE(LVAR_GCALL, "v"),
+    DEFCODE(LVAR_GPRIM, "v"),
+    DEFCODE(LVAR_LVAR, "v"),
+    DEFCODE(NUMEQ_FJUMP, "ck"),
 };
 
 /* Type predicate */
@@ -141,6 +189,10 @@ int is_lt_byte(lt *object) {
   return ((intptr_t)object & BYTE_MASK) == BYTE_TAG;
 }
 
+int is_lt_unicode(lt *object) {
+  return ((intptr_t)object & CHAR_MASK) == CHAR_TAG;
+}
+
 int isfixnum(lt *object) {
   return ((intptr_t)object & FIXNUM_MASK) == FIXNUM_TAG;
 }
@@ -153,16 +205,25 @@ int is_of_type(lisp_object_t *object, enum TYPE type) {
   return is_pointer(object) && (object->type == type? TRUE: FALSE);
 }
 
+int is_immediate_float(lt *object) {
+  return ((intptr_t)object & FLOAT_MASK) == FLOAT_TAG;
+}
+
+int is_lt_float(lt *object) {
+  return is_immediate_float(object) || is_of_type(object, LT_FLOAT);
+}
+
 #define mktype_pred(func_name, type)            \
   int func_name(lisp_object_t *object) {        \
     return is_of_type(object, type);            \
   }
 
 mktype_pred(is_lt_bignum, LT_BIGNUM)
+mktype_pred(is_lt_code, LT_CODE)
 mktype_pred(is_lt_environment, LT_ENVIRONMENT)
 mktype_pred(is_lt_exception, LT_EXCEPTION)
-mktype_pred(is_lt_float, LT_FLOAT)
 mktype_pred(is_lt_function, LT_FUNCTION)
+mktype_pred(is_lt_hash_table, LT_HASH_TABLE)
 mktype_pred(is_lt_input_port, LT_INPUT_PORT)
 mktype_pred(is_lt_mpflonum, LT_MPFLONUM)
 mktype_pred(is_lt_output_port, LT_OUTPUT_PORT)
@@ -172,7 +233,6 @@ mktype_pred(is_lt_primitive, LT_PRIMITIVE)
 mktype_pred(is_lt_string, LT_STRING)
 mktype_pred(is_lt_symbol, LT_SYMBOL)
 mktype_pred(is_lt_type, LT_TYPE)
-mktype_pred(is_lt_unicode, LT_UNICODE)
 mktype_pred(is_lt_vector, LT_VECTOR)
 
 int is_immediate(lt *object) {
@@ -215,13 +275,47 @@ int isnumber(lisp_object_t *object) {
   return isfixnum(object) || is_lt_float(object);
 }
 
+// The numbers which can be ordered by `>' and `<'
+int is_real_number(lt *object) {
+  return isnumber(object) || is_lt_bignum(object) || is_lt_mpflonum(object);
+}
+
 /* Constructor functions */
-lt *allocate_object(void) {
-  return GC_MALLOC(sizeof(struct lisp_object_t));
+// The number of bytes allocated for an object of each type, which is the type
+// word followed by only the member of the union used by the type. A pair takes
+// three words instead of the size of the largest member.
+#define OBJECT_SIZE(member) (offsetof(struct lisp_object_t, u) + sizeof(((lt *)0)->u.member))
+
+size_t object_sizes[] = {
+    [LT_BIGNUM] = OBJECT_SIZE(bignum),
+    [LT_CODE] = OBJECT_SIZE(code),
+    [LT_ENVIRONMENT] = OBJECT_SIZE(environment),
+    [LT_EXCEPTION] = OBJECT_SIZE(exception),
+    [LT_FUNCTION] = OBJECT_SIZE(function),
+    [LT_FLOAT] = OBJECT_SIZE(float_num),
+    [LT_HASH_TABLE] = OBJECT_SIZE(hash_table),
+    [LT_INPUT_PORT] = OBJECT_SIZE(port),
+    [LT_MPFLONUM] = OBJECT_SIZE(mpflonum),
+    [LT_OPCODE] = OBJECT_SIZE(opcode),
+    [LT_OUTPUT_PORT] = OBJECT_SIZE(port),
+    [LT_PACKAGE] = OBJECT_SIZE(package),
+    [LT_PAIR] = OBJECT_SIZE(pair),
+    [LT_PRIMITIVE] = OBJECT_SIZE(primitive),
+    [LT_STRING] = OBJECT_SIZE(string),
+    [LT_STRUCT] = OBJECT_SIZE(structure),
+    [LT_SYMBOL] = OBJECT_SIZE(symbol),
+    [LT_TIME] = OBJECT_SIZE(time),
+    [LT_TYPE] = OBJECT_SIZE(type),
+    [LT_VECTOR] = OBJECT_SIZE(vector),
+};
+
+lt *allocate_object(enum TYPE type) {
+  assert(object_sizes[type] != 0);
+  return GC_MALLOC(object_sizes[type]);
 }
 
 lisp_object_t *make_object(enum TYPE type) {
-  lt *obj = allocate_object();
+  lt *obj = allocate_object(type);
   obj->type = type;
   return obj;
 }
@@ -245,8 +339,23 @@ lisp_object_t *make_byte(char value) {
   return (lt *)((((intptr_t)value) << BYTE_BITS) | BYTE_TAG);
 }
 
-lt *make_fixnum(int value) {
-  return (lt *)((value << FIXNUM_BITS) | FIXNUM_TAG);
+lt *make_fixnum(intptr_t value) {
+  return (lt *)(((uintptr_t)value << FIXNUM_BITS) | FIXNUM_TAG);
+}
+
+// The limbs of bignums and mpflonums are allocated by the GC as well, so they
+// are reclaimed together with the objects holding them. They contain no
+// pointers, so they are not scanned.
+void *gmp_allocate(size_t size) {
+  return GC_MALLOC_ATOMIC(size);
+}
+
+void *gmp_reallocate(void *ptr, size_t old_size, size_t new_size) {
+  return GC_REALLOC(ptr, new_size);
+}
+
+void gmp_free(void *ptr, size_t size) {
+  GC_FREE(ptr);
 }
 
 lt *make_bignum(mpz_t value) {
@@ -255,6 +364,17 @@ lt *make_bignum(mpz_t value) {
   return obj;
 }
 
+lt *make_code(int length, intptr_t *stream, lt **constants, int max_stack) {
+  lt *obj = make_object(LT_CODE);
+  code_length(obj) = length;
+  code_max_stack(obj) = max_stack;
+  code_nhandlers(obj) = 0;
+  code_handlers(obj) = NULL;
+  code_stream(obj) = stream;
+  code_constants(obj) = constants;
+  return obj;
+}
+
 lt *make_environment(lt *bindings, lt *next) {
   lt *env = make_object(LT_ENVIRONMENT);
   environment_bindings(env) = bindings;
@@ -267,22 +387,63 @@ lt *make_exception(char *message, int signal_flag, lt *tag, lt *backtrace) {
   exception_msg(ex) = message;
   exception_flag(ex) = signal_flag;
   exception_backtrace(ex) = backtrace;
+  exception_frames(ex) = NULL;
+  exception_nframes(ex) = 0;
   exception_tag(ex) = tag;
   return ex;
 }
 
-lisp_object_t *make_float(float value) {
+// The bits of a double rotated left by one bit, which puts the exponent at the
+// highest bits and the sign at the lowest one
+#define FLOAT_EXPONENT_SHIFT 53
+
+lisp_object_t *make_float(double value) {
+#if INTPTR_MAX == INT64_MAX
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  uint64_t rotated = (bits << 1) | (bits >> 63);
+  uint64_t exponent = rotated >> FLOAT_EXPONENT_SHIFT;
+  if (rotated <= 1)
+    return (lt *)((rotated << FLOAT_BITS) | FLOAT_TAG);
+  if (FLOAT_EXPONENT_MIN <= exponent && exponent <= FLOAT_EXPONENT_MAX) {
+    rotated -= (uint64_t)(FLOAT_EXPONENT_MIN - 1) << FLOAT_EXPONENT_SHIFT;
+    return (lt *)((rotated << FLOAT_BITS) | FLOAT_TAG);
+  }
+#endif
   lisp_object_t *flt_num = make_object(LT_FLOAT);
-  float_value(flt_num) = value;
+  boxed_float_value(flt_num) = value;
   return flt_num;
 }
 
+double float_value(lt *x) {
+  if (is_pointer(x))
+    return boxed_float_value(x);
+  uint64_t rotated = (uint64_t)(uintptr_t)x >> FLOAT_BITS;
+  if (rotated > 1)
+    rotated += (uint64_t)(FLOAT_EXPONENT_MIN - 1) << FLOAT_EXPONENT_SHIFT;
+  uint64_t bits = (rotated >> 1) | (rotated << 63);
+  double value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+lt *make_lt_hash_table(hash_table_t *table, lt *test) {
+  lt *obj = make_object(LT_HASH_TABLE);
+  hash_table_table(obj) = table;
+  hash_table_test(obj) = test;
+  return obj;
+}
+
 lt *make_function(lt *args, lt *code, lt *env) {
   lt *func = make_object(LT_FUNCTION);
   function_args(func) = args;
   function_code(func) = code;
   function_env(func) = env;
   function_name(func) = the_undef;
+  function_body(func) = the_undef;
+  function_nrequired(func) = 0;
+  function_restp(func) = FALSE;
+  function_frame_size(func) = 0;
   return func;
 }
 
@@ -351,21 +512,10 @@ lisp_object_t *make_primitive(int arity, void *C_function, char *Lisp_name, int
   primitive_restp(p) = restp;
   primitive_Lisp_name(p) = Lisp_name;
   primitive_signature(p) = make_empty_list();
+  primitive_return_type(p) = the_undef;
   return p;
 }
 
-lt *make_retaddr(lt *code, lt *env, lt *fn, int pc, int throw_flag, int sp, int is_multi) {
-  lt *retaddr = make_object(LT_RETADDR);
-  retaddr_code(retaddr) = code;
-  retaddr_env(retaddr) = env;
-  retaddr_fn(retaddr) = fn;
-  retaddr_is_multi(retaddr) = is_multi;
-  retaddr_nvalues(retaddr) = 0;
-  retaddr_pc(retaddr) = pc;
-  retaddr_throw_flag(retaddr) = throw_flag;
-  return retaddr;
-}
-
 lt *make_string(int length, uint32_t *value) {
   lt *string = make_object(LT_STRING);
   string_length(string) = length;
@@ -389,9 +539,23 @@ lisp_object_t *make_symbol(char *name, lt *package) {
   symbol_macro(symbol) = the_undef;
   symbol_package(symbol) = package;
   symbol_value(symbol) = the_undef;
+  symbol_dependents(symbol) = make_empty_list();
+  symbol_form(symbol) = NOT_SPECIAL_FORM;
+  symbol_gensym(symbol) = 0;
   return symbol;
 }
 
+// The name of a symbol made by gensym is formatted the first time it is asked
+// for, since most of them are never printed.
+char *ensure_symbol_name(lt *symbol) {
+  if (symbol_name(symbol) == NULL) {
+    char buffer[32];
+    int n = sprintf(buffer, "G%d", symbol_gensym(symbol));
+    symbol_name(symbol) = strndup(buffer, n);
+  }
+  return symbol_name(symbol);
+}
+
 lt *make_time(struct tm *value) {
   lt *obj = make_object(LT_TIME);
   time_value(obj) = value;
@@ -406,9 +570,7 @@ lt *make_type(enum TYPE type, char *name) {
 }
 
 lt *make_unicode(uint32_t value) {
-  lt *obj = make_object(LT_UNICODE);
-  unicode_data(obj) = value;
-  return obj;
+  return (lt *)((((intptr_t)value) << CHAR_BITS) | CHAR_TAG);
 }
 
 lisp_object_t *make_vector(int length) {
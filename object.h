@@ -20,6 +20,7 @@
 int debug;
 int is_check_exception;
 int is_check_type;
+int is_inline;
 /* Opcode */
 int opcode_max_length;
 hash_table_t *prim2op_map;
@@ -66,12 +67,17 @@ lisp_object_t *standard_out;
 lisp_object_t *symbol_list;
 lisp_object_t *the_undef;
 
+extern size_t object_sizes[];
+
 extern int is_pointer(lt *);
 extern int is_lt_bignum(lt *);
+extern int is_lt_code(lt *);
 extern int is_lt_environment(lt *);
 extern int is_lt_exception(lt *);
 extern int is_lt_float(lt *);
+extern int is_immediate_float(lt *);
 extern int is_lt_function(lt *);
+extern int is_lt_hash_table(lt *);
 extern int is_lt_input_port(lt *);
 extern int is_lt_mpflonum(lt *);
 extern int is_lt_opcode(lt *);
@@ -96,6 +102,8 @@ extern int isboolean(lt *);
 extern int is_signaled(lt *);
 extern int isnull_env(lt *);
 extern int isnumber(lt *);
+extern int is_real_number(lt *);
+extern int is_original_fn(lt *);
 extern int isopcode_fn(lt *);
 // Hash Table
 extern hash_table_t *make_hash_table(int, hash_fn_t, comp_fn_t);
@@ -107,12 +115,18 @@ extern lt *make_eof(void);
 extern lt *make_undef(void);
 extern lt *make_close(void);
 extern lt *make_byte(char);
-extern lt *make_fixnum(int);
+extern lt *make_fixnum(intptr_t);
+extern void *gmp_allocate(size_t);
+extern void *gmp_reallocate(void *, size_t, size_t);
+extern void gmp_free(void *, size_t);
 extern lt *make_bignum(mpz_t);
+extern lt *make_code(int, intptr_t *, lt **, int);
 extern lt *make_environment(lt *, lt *);
 extern lt *make_exception(char *, int, lt *, lt *backtrace);
-extern lt *make_float(float);
+extern lt *make_float(double);
+extern double float_value(lt *);
 extern lt *make_function(lt *args, lt *code, lt *env);
+extern lt *make_lt_hash_table(hash_table_t *, lt *);
 extern lt *make_input_port(FILE *);
 extern lt *make_input_string_port(char *);
 extern lt *make_mpflonum(mpf_t);
@@ -122,10 +136,10 @@ extern lt *make_output_string_port(char *);
 extern lt *make_package(lt *, hash_table_t *);
 extern lt *make_pair(lt *, lt *);
 extern lt *make_primitive(int, void *, char *, int);
-extern lt *make_retaddr(lt *code, lt *env, lt *fn, int pc, int throw_flag, int sp, int is_multi);
 extern lt *make_string(int, uint32_t *);
 extern lt *make_structure(lt *name, int nfield);
 extern lt *make_symbol(char *, lt *);
+extern char *ensure_symbol_name(lt *);
 extern lt *make_time(struct tm *);
 extern lt *make_type(enum TYPE, char *);
 extern lt *make_unicode(uint32_t);
@@ -9,6 +9,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <pwd.h>
 #include <stdarg.h>
 #include <stdint.h>
@@ -51,7 +52,14 @@
 #define SIG(Lisp_name, ...) \
   do { \
     lt *func = symbol_value(S(Lisp_name)); \
-    primitive_signature(func) = raw_list(__VA_ARGS__, NULL); \
+    primitive_signature(func) = compile_signature(raw_list(__VA_ARGS__, NULL)); \
+  } while (0)
+
+// Declares the type of the values returned by a primitive function
+#define RET(Lisp_name, type) \
+  do { \
+    lt *func = symbol_value(S(Lisp_name)); \
+    primitive_return_type(func) = make_fixnum(pred_mask(type)); \
   } while (0)
 
 #define OR(...) make_pair(S("or"), raw_list(__VA_ARGS__, NULL))
@@ -115,7 +123,7 @@ void writef(lt *dest, const char *format, ...) {
           break;
         case 'd':
           assert(isfixnum(arg));
-          nch = fprintf(output_port_stream(dest), "%d", fixnum_value(arg));
+          nch = fprintf(output_port_stream(dest), "%" PRIdPTR, fixnum_value(arg));
           output_port_colnum(dest) += nch;
           break;
         case '?':
@@ -155,39 +163,71 @@ void write_code_point(uint32_t cp, FILE *fp) {
     putc(c[i], fp);
 }
 
-void write_compiled_function(lt *function, int indent, lt *dest) {
-  writef(dest, "#<COMPILED-FUNCTION %p name: %?\n", function, function_name(function));
-  assert(is_lt_vector(function_code(function)));
-  for (int i = 0; i < vector_length(function_code(function)); i++) {
-    lt *ins = vector_value(function_code(function))[i];
-    write_n_spaces(indent, dest);
-    if (is_label(ins)) {
-      writef(dest, "%S:", ins);
-      int rest_width = 8 - (strlen(symbol_name(ins)) + 2);
-      write_n_spaces(rest_width, dest);
+void write_compiled_function(lt *, int, lt *);
+
+// Writes the instruction at `ip' in the stream of `code', and returns the
+// number of words it occupies.
+int write_instruction(lt *code, intptr_t *ip, lt *dest) {
+  enum OPCODE_TYPE name = vm_word_opcode(*ip);
+  lt *opcode = opcode_ref(name);
+  char *format = opcode_format(opcode);
+  write_raw_string(opcode_op(opcode), dest);
+  int rest_width = opcode_max_length + 1 - strlen(opcode_op(opcode));
+  write_n_spaces(rest_width, dest);
+  for (int i = 0; format[i] != '\0'; i++) {
+    intptr_t word = ip[i + 1];
+    if (format[i] == 'k')
       continue;
-    } else
-      write_raw_string("    ", dest);
-    write_raw_string(opcode_op(ins), dest);
-    int rest_width = opcode_max_length + 1 - strlen(opcode_op(ins));
-    write_n_spaces(rest_width, dest);
-    if (opcode_name(ins) == FN) {
-      write_compiled_function(op_fn_func(ins), output_port_colnum(dest), dest);
-    } else {
-      int len = opcode_length(ins);
-      for (int j = 0; j < len; j++) {
-        write_object(opargn(ins, j), dest);
-        if (j != opcode_length(ins) - 1)
-          write_raw_char(' ', dest);
+    if (i != 0)
+      write_raw_char(' ', dest);
+    switch (format[i]) {
+      case 'c': {
+        lt *constant = code_constants(code)[word];
+        if (name == FN)
+          write_compiled_function(constant, output_port_colnum(dest), dest);
+        else
+          write_object(constant, dest);
       }
+        break;
+      case 'i': case 'v':
+        writef(dest, "%d", make_fixnum(word));
+        break;
+      case 'l':
+        writef(dest, "%d", make_fixnum((intptr_t *)word - code_stream(code)));
+        break;
     }
+  }
+  return 1 + strlen(format);
+}
+
+// Writes one instruction per line, each one is prefixed by its offset in the stream.
+void write_code_body(lt *code, int indent, lt *dest) {
+  intptr_t *ip = code_stream(code);
+  while (ip < code_stream(code) + code_length(code)) {
+    write_n_spaces(indent, dest);
+    int nch = fprintf(output_port_stream(dest), "%3ld ", (long)(ip - code_stream(code)));
+    output_port_colnum(dest) += nch;
+    ip += write_instruction(code, ip, dest);
     write_raw_char('\n', dest);
   }
-  for (int j = 0; j < indent; j++)
-    write_raw_char(' ', dest);
+  for (int i = 0; i < code_nhandlers(code); i++) {
+    handler_t *handler = &code_handlers(code)[i];
+    write_n_spaces(indent, dest);
+    int nch = fprintf(output_port_stream(dest), "    CATCH    %d-%d => %d",
+                      handler->start, handler->end, handler->handler);
+    output_port_colnum(dest) += nch;
+    write_raw_char('\n', dest);
+  }
+  write_n_spaces(indent, dest);
   write_raw_char('>', dest);
 }
 
+void write_compiled_function(lt *function, int indent, lt *dest) {
+  writef(dest, "#<COMPILED-FUNCTION %p name: %?\n", function, function_name(function));
+  assert(is_lt_code(function_code(function)));
+  write_code_body(function_code(function), indent, dest);
+}
+
 void write_symbol(lt *x, lt *dest) {
   lt *pkg = symbol_package(x);
   lt *tmp = package_used_packages(package);
@@ -203,7 +243,17 @@ void write_symbol(lt *x, lt *dest) {
   }
   if (flag == FALSE)
     writef(dest, "%s::", package_name(pkg));
-  write_raw_string(symbol_name(x), dest);
+  write_raw_string(ensure_symbol_name(x), dest);
+}
+
+void write_unicode(lt *x, lt *dest) {
+  write_raw_string("#\\", dest);
+  if (unicode_data(x) == ' ')
+    write_raw_string("space", dest);
+  else if (unicode_data(x) == '\n')
+    write_raw_string("newline", dest);
+  else
+    write_code_point(unicode_data(x), output_port_stream(dest));
 }
 
 void write_object(lt *x, lt *output_file) {
@@ -213,6 +263,10 @@ void write_object(lt *x, lt *output_file) {
       writef(output_file, "#<BYTE %d>", make_fixnum(byte_value(x)));
     else if (isfixnum(x))
       writef(output_file, "%d", x);
+    else if (is_lt_unicode(x))
+      write_unicode(x, output_file);
+    else if (is_lt_float(x))
+      writef(output_file, "%f", x);
     else if (iseof(x))
       write_raw_string("#<EOF>", output_file);
     else if (isnull(x))
@@ -235,13 +289,19 @@ void write_object(lt *x, lt *output_file) {
       mpz_out_str(stream, 10, bignum_value(x));
     }
     break;
+    case LT_CODE: {
+      int indent = output_port_colnum(output_file);
+      writef(output_file, "#<CODE %p\n", x);
+      write_code_body(x, indent, output_file);
+    }
+    break;
     case LT_ENVIRONMENT:
       writef(output_file, "#<ENVIRONMENT %? %p>", environment_bindings(x), x);
       break;
     case LT_EXCEPTION: {
       writef(output_file, "%S: ", exception_tag(x));
       writef(output_file, "%s\n", import_C_string(exception_msg(x)));
-      lt *backtrace = exception_backtrace(x);
+      lt *backtrace = lt_exception_backtrace(x);
       while (!isnull(backtrace)) {
         lt *fn = pair_head(backtrace);
         if (is_lt_function(fn))
@@ -262,6 +322,10 @@ void write_object(lt *x, lt *output_file) {
       write_compiled_function(x, indent, output_file);
     }
     break;
+    case LT_HASH_TABLE:
+      writef(output_file, "#<HASH-TABLE %p test: %S count: %d>",
+             x, hash_table_test(x), make_fixnum(ht_count(hash_table_table(x))));
+      break;
     case LT_INPUT_PORT:
       writef(output_file, "#<INPUT-FILE %p>", x);
       break;
@@ -292,9 +356,6 @@ void write_object(lt *x, lt *output_file) {
       write_raw_string(primitive_Lisp_name(x), output_file);
       writef(output_file, " %p>", x);
       break;
-    case LT_RETADDR:
-      writef(output_file, "#<RETADDR %p pc: %d>", x, make_fixnum(retaddr_pc(x)));
-      break;
     case LT_STRING: {
       char *value = export_C_string(x);
       write_raw_string("\"", output_file);
@@ -326,15 +387,6 @@ void write_object(lt *x, lt *output_file) {
       write_raw_string(type_name(x), output_file);
       write_raw_char('>', output_file);
       break;
-    case LT_UNICODE:
-      write_raw_string("#\\", output_file);
-      if (unicode_data(x) == ' ')
-        write_raw_string("space", output_file);
-      else if (unicode_data(x) == '\n')
-        write_raw_string("newline", output_file);
-      else
-        write_code_point(unicode_data(x), output_port_stream(output_file));
-      break;
     case LT_VECTOR: {
       lisp_object_t **vector = vector_value(x);
       write_raw_string("[", output_file);
@@ -417,15 +469,41 @@ lt *lt_exception_tag(lt *exception) {
   return exception_tag(exception);
 }
 
+// The functions in the frames unwound are appended to the backtrace, innermost
+// first, only when the backtrace is inspected.
+lt *lt_exception_backtrace(lt *exception) {
+  int n = exception_nframes(exception);
+  if (n > 0) {
+    frame_t *frames = exception_frames(exception);
+    lt *fns = the_empty_list;
+    for (int i = 0; i < n; i++)
+      fns = make_pair(frames[i].fn, fns);
+    exception_backtrace(exception) = append2(exception_backtrace(exception), fns);
+    exception_frames(exception) = NULL;
+    exception_nframes(exception) = 0;
+  }
+  return exception_backtrace(exception);
+}
+
 lt *lt_signal_exception(lt *message) {
   return signal_exception(export_C_string(message));
 }
 
+// Signals a caught exception again
+lt *lt_throw(lt *exception) {
+  exception_flag(exception) = TRUE;
+  return exception;
+}
+
 void init_prim_exception(void) {
+  NOREST(1, lt_exception_backtrace, "exception-backtrace");
+  SIG("exception-backtrace", T(LT_EXCEPTION));
   NOREST(1, lt_exception_tag, "exception-tag");
   SIG("exception-tag", T(LT_EXCEPTION));
   NOREST(1, lt_signal_exception, "signal");
   SIG("signal", T(LT_STRING));
+  NOREST(1, lt_throw, "throw");
+  SIG("throw", T(LT_EXCEPTION));
 }
 
 /* Function */
@@ -522,6 +600,148 @@ void init_prim_function(void) {
   NOREST(2, lt_simple_apply, "apply");
 }
 
+/* Hash Table */
+// Spreads the bits of a word over the bits used as the index into the entries
+unsigned int mix_hash(uintptr_t n) {
+  n ^= n >> 16;
+  n *= 0x45d9f3b;
+  n ^= n >> 16;
+  return (unsigned int)n;
+}
+
+unsigned int eq_hash_fn(void *x) {
+  return mix_hash((uintptr_t)x);
+}
+
+int eq_comp_fn(void *x, void *y) {
+  return x != y;
+}
+
+// A fixnum is eql? to a float when they are equal as floats, and to a bignum
+// of the same value, so numbers are hashed by their values converted to double.
+unsigned int eql_hash_fn(void *x) {
+  double value;
+  if (is_lt_bignum(x)) {
+    mpz_ptr n = bignum_value((lt *)x);
+    if (!mpz_fits_slong_p(n) || !is_fixnum_value(mpz_get_si(n)))
+      return mix_hash(mpz_get_si(n));
+    value = mpz_get_si(n);
+  } else if (isnumber(x))
+    value = isfixnum(x)? fixnum_value(x): float_value((lt *)x);
+  else
+    return eq_hash_fn(x);
+  if (value == 0)
+    value = 0;
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return mix_hash(bits ^ (bits >> 32));
+}
+
+int eql_comp_fn(void *x, void *y) {
+  return isfalse(lt_eql(x, y));
+}
+
+// Only the first elements of a list or vector and the first levels of nesting
+// are hashed, which bounds the time spent on long or circular structures.
+#define EQUAL_HASH_LENGTH 8
+#define EQUAL_HASH_DEPTH 4
+
+unsigned int equal_hash(lt *x, int depth) {
+  if (x == NULL || depth == 0)
+    return 0;
+  unsigned int hash = 17;
+  if (is_lt_pair(x)) {
+    for (int i = 0; is_lt_pair(x) && i < EQUAL_HASH_LENGTH; x = pair_tail(x), i++)
+      hash = hash * 31 + equal_hash(pair_head(x), depth - 1);
+    if (!is_lt_pair(x))
+      hash = hash * 31 + equal_hash(x, depth - 1);
+    return hash;
+  }
+  if (is_lt_vector(x)) {
+    hash += vector_length(x);
+    for (int i = 0; i < vector_length(x) && i < EQUAL_HASH_LENGTH; i++)
+      hash = hash * 31 + equal_hash(vector_value(x)[i], depth - 1);
+    return hash;
+  }
+  return eql_hash_fn(x);
+}
+
+unsigned int equal_hash_fn(void *x) {
+  return equal_hash(x, EQUAL_HASH_DEPTH);
+}
+
+int equal_comp_fn(void *x, void *y) {
+  return isfalse(lt_equal(x, y));
+}
+
+lt *lt_make_hash_table(lt *test) {
+  hash_table_t *table;
+  if (test == S("eq?"))
+    table = make_hash_table(8, eq_hash_fn, eq_comp_fn);
+  else if (test == S("eql?"))
+    table = make_hash_table(8, eql_hash_fn, eql_comp_fn);
+  else if (test == S("equal?"))
+    table = make_hash_table(8, equal_hash_fn, equal_comp_fn);
+  else
+    return signal_exception("The test of a hash table must be one of eq?, eql? and equal?");
+  return make_lt_hash_table(table, test);
+}
+
+lt *lt_hash_table_count(lt *table) {
+  return make_fixnum(ht_count(hash_table_table(table)));
+}
+
+// Returns `default_value' if there is no value associated with `key'
+lt *lt_hash_table_get(lt *table, lt *key, lt *default_value) {
+  lt *value = search_ht(key, hash_table_table(table));
+  return value != NULL? value: default_value;
+}
+
+lt *lt_hash_table_keys(lt *table) {
+  hash_table_t *ht = hash_table_table(table);
+  lt *keys = the_empty_list;
+  for (int i = ht_next_entry(ht, -1); i != -1; i = ht_next_entry(ht, i))
+    keys = make_pair(en_key(&ht_entries(ht)[i]), keys);
+  return keys;
+}
+
+lt *lt_hash_table_put(lt *table, lt *key, lt *value) {
+  set_ht(key, value, hash_table_table(table));
+  return value;
+}
+
+// Returns whether there was a value associated with `key'
+lt *lt_hash_table_remove(lt *table, lt *key) {
+  return booleanize(remove_ht(key, hash_table_table(table)));
+}
+
+lt *lt_hash_table_values(lt *table) {
+  hash_table_t *ht = hash_table_table(table);
+  lt *values = the_empty_list;
+  for (int i = ht_next_entry(ht, -1); i != -1; i = ht_next_entry(ht, i))
+    values = make_pair(en_value(&ht_entries(ht)[i]), values);
+  return values;
+}
+
+void init_prim_hash_table(void) {
+  NOREST(1, lt_make_hash_table, "make-hash-table");
+  SIG("make-hash-table", T(LT_SYMBOL));
+  NOREST(1, lt_hash_table_count, "hash-table-count");
+  SIG("hash-table-count", T(LT_HASH_TABLE));
+  RET("hash-table-count", T(LT_FIXNUM));
+  NOREST(3, lt_hash_table_get, "hash-table-get");
+  SIG("hash-table-get", T(LT_HASH_TABLE));
+  NOREST(1, lt_hash_table_keys, "hash-table-keys");
+  SIG("hash-table-keys", T(LT_HASH_TABLE));
+  NOREST(3, lt_hash_table_put, "hash-table-put!");
+  SIG("hash-table-put!", T(LT_HASH_TABLE));
+  NOREST(2, lt_hash_table_remove, "hash-table-remove!");
+  SIG("hash-table-remove!", T(LT_HASH_TABLE));
+  RET("hash-table-remove!", T(LT_BOOL));
+  NOREST(1, lt_hash_table_values, "hash-table-values");
+  SIG("hash-table-values", T(LT_HASH_TABLE));
+}
+
 /* Input Port */
 lt *lt_close_in(lt *file) {
   assert(is_lt_input_port(file));
@@ -601,32 +821,69 @@ lt *lt_nt_level(lt *n) {
 }
 
 /** Bignum **/
+// Returns a fixnum instead if the result fits in one, so that an integer has
+// only one representation.
+lt *normalize_bignum(mpz_t value) {
+  if (mpz_fits_slong_p(value) && is_fixnum_value(mpz_get_si(value)))
+    return make_fixnum(mpz_get_si(value));
+  return make_bignum(value);
+}
+
 lt *lt_bg_add(lt *n, lt *m) {
   mpz_t res;
   mpz_init(res);
   mpz_add(res, bignum_value(n), bignum_value(m));
-  return make_bignum(res);
+  return normalize_bignum(res);
 }
 
 lt *lt_bg_sub(lt *n, lt *m) {
   mpz_t res;
   mpz_init(res);
   mpz_sub(res, bignum_value(n), bignum_value(m));
-  return make_bignum(res);
+  return normalize_bignum(res);
 }
 
 lt *lt_bg_mul(lt *n, lt *m) {
   mpz_t res;
   mpz_init(res);
   mpz_mul(res, bignum_value(n), bignum_value(m));
-  return make_bignum(res);
+  return normalize_bignum(res);
 }
 
 lt *lt_bg_div(lt *n, lt *m) {
   mpz_t res;
   mpz_init(res);
   mpz_div(res, bignum_value(n), bignum_value(m));
-  return make_bignum(res);
+  return normalize_bignum(res);
+}
+
+// Adds the integer `m' to the bignum `acc' in place, so that a loop
+// accumulating a bignum reuses its limbs instead of allocating a new one on
+// each step. `acc' stays a bignum even if its value fits in a fixnum.
+//
+// Every reference to `acc' sees the new value, so it must be a bignum owned by
+// the caller, such as one made by fixnum->bignum, and never a literal in the
+// constants of a function, a key in a hash table, or the result of generic
+// arithmetic that may be shared.
+lt *lt_bg_add_in_place(lt *acc, lt *m) {
+  if (isfixnum(m)) {
+    if (fixnum_value(m) >= 0)
+      mpz_add_ui(bignum_value(acc), bignum_value(acc), fixnum_value(m));
+    else
+      mpz_sub_ui(bignum_value(acc), bignum_value(acc), -fixnum_value(m));
+  } else
+    mpz_add(bignum_value(acc), bignum_value(acc), bignum_value(m));
+  return acc;
+}
+
+// Multiplies the bignum `acc' by the integer `m' in place, with the same
+// restriction on `acc' as lt_bg_add_in_place
+lt *lt_bg_mul_in_place(lt *acc, lt *m) {
+  if (isfixnum(m))
+    mpz_mul_si(bignum_value(acc), bignum_value(acc), fixnum_value(m));
+  else
+    mpz_mul(bignum_value(acc), bignum_value(acc), bignum_value(m));
+  return acc;
 }
 
 lt *lt_bg_eq(lt *n, lt *m) {
@@ -648,35 +905,54 @@ lt *lt_mkbg(lt *str) {
 }
 
 /* Arithmetic Operations for Fixnum */
+lt *lt_fx2bg(lt *n) {
+  mpz_t num;
+  mpz_init(num);
+  mpz_set_si(num, fixnum_value(n));
+  return make_bignum(num);
+}
+
+// The results out of the range of fixnums are promoted to bignums
+lt *make_integer(intptr_t value) {
+  if (is_fixnum_value(value))
+    return make_fixnum(value);
+  mpz_t num;
+  mpz_init(num);
+  mpz_set_si(num, value);
+  return make_bignum(num);
+}
+
 lt *lt_fx_add(lt *n, lt *m) {
-  return make_fixnum(fixnum_value(n) + fixnum_value(m));
+  intptr_t result;
+  if (__builtin_add_overflow(fixnum_value(n), fixnum_value(m), &result))
+    return lt_bg_add(lt_fx2bg(n), lt_fx2bg(m));
+  return make_integer(result);
 }
 
 lt *lt_fx_sub(lt *n, lt *m) {
-  return make_fixnum(fixnum_value(n) - fixnum_value(m));
+  intptr_t result;
+  if (__builtin_sub_overflow(fixnum_value(n), fixnum_value(m), &result))
+    return lt_bg_sub(lt_fx2bg(n), lt_fx2bg(m));
+  return make_integer(result);
 }
 
 lt *lt_fx_mul(lt *n, lt *m) {
-  return make_fixnum(fixnum_value(n) * fixnum_value(m));
+  intptr_t result;
+  if (__builtin_mul_overflow(fixnum_value(n), fixnum_value(m), &result))
+    return lt_bg_mul(lt_fx2bg(n), lt_fx2bg(m));
+  return make_integer(result);
 }
 
 lt *lt_fx_div(lt *n, lt *m) {
   if (fixnum_value(m) == 0)
     return signal_exception("Divided by zero");
-  return make_fixnum(fixnum_value(n) / fixnum_value(m));
+  return make_integer(fixnum_value(n) / fixnum_value(m));
 }
 
 lt *lt_fx_eq(lt *n, lt *m) {
   return booleanize(fixnum_value(n) == fixnum_value(m));
 }
 
-lt *lt_fx2bg(lt *n) {
-  mpz_t num;
-  mpz_init(num);
-  mpz_set_si(num, fixnum_value(n));
-  return make_bignum(num);
-}
-
 lt *lt_fx2fp(lt *n) {
   return make_float(fixnum_value(n));
 }
@@ -751,8 +1027,29 @@ lt *lt_mpf_eq(lt *n, lt *m) {
   return booleanize(mpf_cmp(mpflonum_value(n), mpflonum_value(m)) == 0);
 }
 
+// Converts a real number to an mpflonum, for comparing it with one
+lt *lt_real2mpf(lt *n) {
+  if (isfixnum(n))
+    return lt_fx2mpf(n);
+  if (is_lt_float(n))
+    return lt_fp2mpf(n);
+  if (is_lt_bignum(n))
+    return lt_bg2mpf(n);
+  return n;
+}
+
 lisp_object_t *lt_gt(lisp_object_t *n, lisp_object_t *m) {
-  assert(isnumber(n) && isnumber(m));
+  assert(is_real_number(n) && is_real_number(m));
+  if (is_lt_mpflonum(n) || is_lt_mpflonum(m))
+    return booleanize(mpf_cmp(mpflonum_value(lt_real2mpf(n)), mpflonum_value(lt_real2mpf(m))) > 0);
+  if (is_lt_bignum(n) && is_lt_bignum(m))
+    return booleanize(mpz_cmp(bignum_value(n), bignum_value(m)) > 0);
+  if (is_lt_bignum(n))
+    return booleanize(isfixnum(m)? mpz_cmp_si(bignum_value(n), fixnum_value(m)) > 0:
+                      mpz_cmp_d(bignum_value(n), float_value(m)) > 0);
+  if (is_lt_bignum(m))
+    return booleanize(isfixnum(n)? mpz_cmp_si(bignum_value(m), fixnum_value(n)) < 0:
+                      mpz_cmp_d(bignum_value(m), float_value(n)) < 0);
   if (isfixnum(n) && isfixnum(m))
     return booleanize(fixnum_value(n) > fixnum_value(m));
   if (isfixnum(n) && is_lt_float(m))
@@ -824,6 +1121,14 @@ void init_prim_arithmetic(void) {
   PFN("bin/", 2, lt_g_div2, pkg_lisp);
   PFN("=", 2, lt_g_eq2, pkg_lisp);
   NOREST(2, lt_gt, ">");
+  /* Bignum */
+  NOREST(2, lt_bg_add_in_place, "bignum-add!");
+  SIG("bignum-add!", T(LT_BIGNUM), OR(T(LT_FIXNUM), T(LT_BIGNUM)));
+  NOREST(2, lt_bg_mul_in_place, "bignum-mul!");
+  SIG("bignum-mul!", T(LT_BIGNUM), OR(T(LT_FIXNUM), T(LT_BIGNUM)));
+  NOREST(1, lt_fx2bg, "fixnum->bignum");
+  SIG("fixnum->bignum", T(LT_FIXNUM));
+  RET("fixnum->bignum", T(LT_BIGNUM));
 }
 
 /* Character */
@@ -834,13 +1139,15 @@ lt *lt_char_code(lt *c) {
 
 lisp_object_t *lt_code_char(lisp_object_t *code) {
   assert(isfixnum(code));
-  return make_byte(fixnum_value(code));
+  return make_unicode(fixnum_value(code));
 }
 
 void init_prim_char(void) {
   NOREST(1, lt_char_code, "char-code");
+  RET("char-code", T(LT_FIXNUM));
   NOREST(1, lt_code_char, "code-char");
   SIG("code-char", T(LT_FIXNUM));
+  RET("code-char", T(LT_UNICODE));
 }
 
 /* Output File */
@@ -985,14 +1292,15 @@ void init_prim_string(void) {
   NOREST(2, lt_char_at, "char-at");
   PFN("string-concat", 2, lt_string_concat, pkg_lisp);
   NOREST(1, lt_string_length, "string-length");
+  RET("string-length", T(LT_FIXNUM));
   PFN("string-search", 2, lt_string_search, pkg_lisp);
   NOREST(3, lt_string_set, "string-set!");
 }
 
 /* Structure */
 lt *lt_get_field(lt *field_name, lt *st) {
-  char *st_name = symbol_name(structure_name(st));
-  int i = compute_field_offset(symbol_name(field_name), st_name);
+  char *st_name = ensure_symbol_name(structure_name(st));
+  int i = compute_field_offset(ensure_symbol_name(field_name), st_name);
   if (i == -1)
     return signal_exception("Undefined field in structure");
   else
@@ -1000,19 +1308,19 @@ lt *lt_get_field(lt *field_name, lt *st) {
 }
 
 lt *lt_make_structure(lt *name, lt *fields) {
-  set_structure(symbol_name(name), fields);
+  set_structure(ensure_symbol_name(name), fields);
   return name;
 }
 
 lt *lt_mkstruct(lt *name) {
-  lt *fs = search_structure(symbol_name(name));
+  lt *fs = search_structure(ensure_symbol_name(name));
   lt *st = make_structure(name, pair_length(fs));
   return st;
 }
 
 lt *lt_set_field(lt *field_name, lt *st, lt *value) {
-  char *st_name = symbol_name(structure_name(st));
-  int i = compute_field_offset(symbol_name(field_name), st_name);
+  char *st_name = ensure_symbol_name(structure_name(st));
+  int i = compute_field_offset(ensure_symbol_name(field_name), st_name);
   if (i == -1)
     return signal_exception("Undefined field in structure");
   else {
@@ -1029,11 +1337,13 @@ void init_prim_structure(void) {
 }
 
 /* Symbol */
+// The symbol is not interned, so the expansions of macros do not fill up the
+// package.
 lt *lt_gensym(void) {
-  static char sym[256];
-  int n = sprintf(sym, "G%d", fixnum_value(gensym_counter));
+  lt *sym = make_symbol(NULL, package);
+  symbol_gensym(sym) = fixnum_value(gensym_counter);
   gensym_counter = make_fixnum(fixnum_value(gensym_counter) + 1);
-  return S(strndup(sym, n));
+  return sym;
 }
 
 lt *lt_intern(lt *name, lt *pkg_name) {
@@ -1053,6 +1363,8 @@ lt *lt_set_symbol_macro(lt *symbol, lt *macro_fn) {
 
 lt *lt_set_symbol_value(lt *symbol, lt *value) {
   symbol_value(symbol) = value;
+  if (is_lt_pair(symbol_dependents(symbol)))
+    invalidate_dependents(symbol);
   return value;
 }
 
@@ -1062,7 +1374,7 @@ lt *lt_symbol_macro(lt *symbol) {
 
 lisp_object_t *lt_symbol_name(lisp_object_t *symbol) {
   assert(is_lt_symbol(symbol));
-  return import_C_string(strdup(symbol_name(symbol)));
+  return import_C_string(strdup(ensure_symbol_name(symbol)));
 }
 
 lt *lt_symbol_package(lt *symbol) {
@@ -1076,15 +1388,24 @@ lisp_object_t *lt_symbol_value(lisp_object_t *symbol) {
 
 void init_prim_symbol(void) {
   NOREST(0, lt_gensym, "gensym");
+  RET("gensym", T(LT_SYMBOL));
   NOREST(2, lt_intern, "intern");
+  SIG("intern", T(LT_STRING), T(LT_STRING));
   NOREST(1, lt_is_bound, "bound?");
   SIG("bound?", T(LT_SYMBOL));
   NOREST(2, lt_set_symbol_macro, "set-symbol-macro!");
+  SIG("set-symbol-macro!", T(LT_SYMBOL));
   NOREST(2, lt_set_symbol_value, "set-symbol-value!");
+  SIG("set-symbol-value!", T(LT_SYMBOL));
   NOREST(1, lt_symbol_macro, "symbol-macro");
+  SIG("symbol-macro", T(LT_SYMBOL));
   NOREST(1, lt_symbol_name, "symbol-name");
+  SIG("symbol-name", T(LT_SYMBOL));
+  RET("symbol-name", T(LT_STRING));
   NOREST(1, lt_symbol_package, "symbol-package");
+  SIG("symbol-package", T(LT_SYMBOL));
   NOREST(1, lt_symbol_value, "symbol-value");
+  SIG("symbol-value", T(LT_SYMBOL));
 }
 
 /* Time */
@@ -1212,12 +1533,16 @@ lt *lt_vector_to_list(lt *vector) {
 void init_prim_vector(void) {
   NOREST(1, lt_list_to_vector, "list->vector");
   NOREST(1, lt_vector_length, "vector-length");
+  SIG("vector-length", T(LT_VECTOR));
+  RET("vector-length", T(LT_FIXNUM));
   NOREST(1, lt_vector_pop, "vector-pop");
   NOREST(2, lt_vector_push, "vector-push");
   NOREST(2, lt_vector_push_extend, "vector-push-extend");
+  SIG("vector-push-extend", T(LT_VECTOR));
   NOREST(2, lt_vector_ref, "vector-ref");
   NOREST(3, lt_vector_set, "vector-set!");
   NOREST(1, lt_vector_to_list, "vector->list");
+  SIG("vector->list", T(LT_VECTOR));
 }
 
 /* List */
@@ -1292,6 +1617,7 @@ void init_prim_list(void) {
   NOREST(2, make_pair, "cons");
   NOREST(1, lt_head, "head");
   NOREST(1, lt_list_nreverse, "list-reverse!");
+  SIG("list-reverse!", OR(T(LT_PAIR), T(LT_EMPTY_LIST)));
   NOREST(2, lt_set_head, "set-head");
   NOREST(2, lt_set_tail, "set-tail");
   NOREST(1, lt_tail, "tail");
@@ -1346,6 +1672,13 @@ lt *lt_eql(lt *x, lt *y) {
     return the_true;
   if (isnumber(x) && isnumber(y))
     return lt_numeric_eq(x, y);
+  if (is_lt_bignum(x) && is_lt_bignum(y))
+    return lt_bg_eq(x, y);
+//  The in-place operations leave bignums holding the values of fixnums
+  if (is_lt_bignum(x) && isfixnum(y))
+    return booleanize(mpz_cmp_si(bignum_value(x), fixnum_value(y)) == 0);
+  if (isfixnum(x) && is_lt_bignum(y))
+    return booleanize(mpz_cmp_si(bignum_value(y), fixnum_value(x)) == 0);
   return the_false;
 }
 
@@ -1367,12 +1700,21 @@ lt *lt_is_constant(lt *object) {
   return make_false();
 }
 
-lt *lt_object_size(void) {
-  return make_fixnum(sizeof(lt));
+// The number of bytes allocated for the object, which is zero if it is immediate
+lt *lt_object_size(lt *object) {
+  if (!is_pointer(object))
+    return make_fixnum(0);
+  return make_fixnum(object_sizes[type_of(object)]);
+}
+
+lt *lt_heap_size(void) {
+  return make_fixnum(GC_get_heap_size());
 }
 
 /* Type */
 int type_of(lisp_object_t *x) {
+  if (is_pointer(x))
+    return x->type;
   if (isboolean(x))
     return LT_BOOL;
   if (is_lt_byte(x))
@@ -1381,14 +1723,53 @@ int type_of(lisp_object_t *x) {
     return LT_EMPTY_LIST;
   if (isfixnum(x))
     return LT_FIXNUM;
+  if (is_lt_unicode(x))
+    return LT_UNICODE;
+  if (is_lt_float(x))
+    return LT_FLOAT;
   if (isclose(x))
     return LT_TCLOSE;
   if (iseof(x))
     return LT_TEOF;
-  if (isundef(x))
-    return LT_TUNDEF;
-  assert(is_pointer(x));
-  return x->type;
+  assert(isundef(x));
+  return LT_TUNDEF;
+}
+
+// Returns the mask of the types satisfying a predicate in the signature of a
+// primitive function, which is a type, an `or' of predicates, or `object'.
+intptr_t pred_mask(lt *pred) {
+  if (is_lt_type(pred))
+    return TYPE_BIT(type_tag(pred));
+  if (pred == S("object"))
+    return ALL_TYPES_MASK;
+  if (is_tag_list(pred, S("or"))) {
+    intptr_t mask = 0;
+    for (lt *ts = pair_tail(pred); is_lt_pair(ts); ts = pair_tail(ts))
+      mask |= pred_mask(pair_head(ts));
+    return mask;
+  }
+  fprintf(stderr, "Unknown type predicate. Please check the signature declarations in function `init_prims' in file `prims.c'.\n");
+  exit(1);
+}
+
+// The predicates are replaced by their masks, which are checked by CHKTYPE
+lt *compile_signature(lt *sig) {
+  for (lt *ps = sig; is_lt_pair(ps); ps = pair_tail(ps))
+    pair_head(ps) = make_fixnum(pred_mask(pair_head(ps)));
+  return sig;
+}
+
+// Returns the predicate satisfied by the types in `mask', for reporting it
+lt *mask_pred(intptr_t mask) {
+  if (mask == ALL_TYPES_MASK)
+    return S("object");
+  lt *types = the_empty_list;
+  for (int t = LT_VECTOR; t >= 0; t--)
+    if (mask & TYPE_BIT(t))
+      types = make_pair(type_ref(t), types);
+  if (is_lt_pair(types) && isnull(pair_tail(types)))
+    return pair_head(types);
+  return make_pair(S("or"), types);
 }
 
 lisp_object_t *lt_type_of(lisp_object_t *object) {
@@ -1415,6 +1796,14 @@ lt *lt_switch_exception_check(void) {
   return booleanize(is_check_exception);
 }
 
+lt *lt_switch_inline(void) {
+  if (is_inline)
+    is_inline = FALSE;
+  else
+    is_inline = TRUE;
+  return booleanize(is_inline);
+}
+
 lt *lt_switch_type_check(void) {
   if (is_check_type)
     is_check_type = FALSE;
@@ -1431,16 +1820,25 @@ void init_prim_general(void) {
   /* Type */
   NOREST(1, lt_type_name, "type-name");
   SIG("type-name", T(LT_TYPE));
+  RET("type-name", T(LT_SYMBOL));
   /* General */
   NOREST(1, lt_is_constant, "is-constant?");
   NOREST(2, lt_eq, "eq?");
+  RET("eq?", T(LT_BOOL));
   NOREST(2, lt_eql, "eql?");
+  RET("eql?", T(LT_BOOL));
   NOREST(2, lt_equal, "equal?");
+  RET("equal?", T(LT_BOOL));
   NOREST(2, lt_is_kind_of, "of-type?");
-  NOREST(0, lt_object_size, "object-size");
+  RET("of-type?", T(LT_BOOL));
+  NOREST(0, lt_heap_size, "heap-size");
+  NOREST(1, lt_object_size, "object-size");
+  RET("object-size", T(LT_FIXNUM));
   NOREST(1, lt_type_of, "type-of");
+  RET("type-of", T(LT_TYPE));
   NOREST(0, lt_switch_debug, "switch-debug");
   NOREST(0, lt_switch_exception_check, "switch-exception-check");
+  NOREST(0, lt_switch_inline, "switch-inline");
   NOREST(0, lt_switch_type_check, "switch-type-check");
 }
 
@@ -1519,56 +1917,41 @@ lisp_object_t *read_character(lisp_object_t *input_file) {
   }
 }
 
-lt *make_flonum(float value, char *lit) {
-  if (value < 0) {
-    mpf_t num;
-    mpf_init(num);
-    mpf_set_str(num, lit, 10);
-    return make_mpflonum(num);
-  } else
-    return make_float(value);
-}
-
-lisp_object_t *read_float(lisp_object_t *input_file, int integer, string_builder_t *sb) {
-  int e = 1;
-  float sum = 0;
+// The literal is converted by `strtod', which rounds it correctly
+lisp_object_t *read_float(lisp_object_t *input_file, string_builder_t *sb) {
+  sb_add_char(sb, '.');
   int c = get_char(input_file);
-  for (; isdigit(c); c = get_char(input_file)) {
-    e *= 10;
-    sum = sum * 10 + c - '0';
+  for (; isdigit(c); c = get_char(input_file))
     sb_add_char(sb, c);
-  }
   unget_char(c, input_file);
-  return make_flonum(integer + sum / e, sb2string(sb));
+  return make_float(strtod(sb2string(sb), NULL));
 }
 
-lt *make_integer(int sign, int sum, char *lit) {
-#define FIXNUM_MAX ((2 << 29) - 1)
-  if (sum > FIXNUM_MAX || sum < 0) {
-    mpz_t num;
-    mpz_init(num);
-    mpz_set_str(num, lit, 10);
-    return make_bignum(num);
-  } else
-    return make_fixnum(sum);
+// An integer literal out of the range of fixnums is read as a bignum
+lt *read_integer(char *lit) {
+  errno = 0;
+  long value = strtol(lit, NULL, 10);
+  if (errno != ERANGE && is_fixnum_value(value))
+    return make_fixnum(value);
+  mpz_t num;
+  mpz_init(num);
+  mpz_set_str(num, lit, 10);
+  return make_bignum(num);
 }
 
+// The sign is kept in the literal, from which the number is converted
 lt *read_fixnum(lt *input_file, int sign, char start) {
   string_builder_t *sb = make_str_builder();
+  if (sign < 0)
+    sb_add_char(sb, '-');
   sb_add_char(sb, start);
-  int sum = start - '0';
   int c = get_char(input_file);
-  for (; isdigit(c); c = get_char(input_file)) {
+  for (; isdigit(c); c = get_char(input_file))
     sb_add_char(sb, c);
-    sum = sum * 10 + c - '0';
-  }
-  if (c == '.') {
-    lt *num = read_float(input_file, sum, sb);
-    float_value(num) *= sign;
-    return num;
-  } else
-    unget_char(c, input_file);
-  return make_integer(sign, sum, sb2string(sb));
+  if (c == '.')
+    return read_float(input_file, sb);
+  unget_char(c, input_file);
+  return read_integer(sb2string(sb));
 }
 
 lt *read_byte(lt *iport) {
@@ -1761,6 +2144,7 @@ void init_prims(void) {
   init_prim_exception();
   init_prim_function();
   init_prim_general();
+  init_prim_hash_table();
   init_prim_input_port();
   init_prim_list();
   init_prim_os();
@@ -1781,6 +2165,17 @@ void init_primitive_opcode(void) {
   } while (0)
 
   ADDOP("cons", CONS);
+  ADDOP("eq?", EQ);
+//  The numeric operators of two arguments
+  ADDOP("+", ADD);
+  ADDOP("bin+", ADD);
+  ADDOP("-", SUB);
+  ADDOP("bin-", SUB);
+  ADDOP("*", MUL);
+  ADDOP("bin*", MUL);
+  ADDOP("=", NUMEQ);
+  ADDOP(">", GT);
+  ADDOP("<", LT);
 }
 
 void load_init_file(void) {
@@ -1792,4 +2187,5 @@ void load_init_file(void) {
   }
   lt *file = make_input_port(fp);
   lt_load_file(file);
+  record_op4prim_functions();
 }
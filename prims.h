@@ -8,6 +8,8 @@
 #ifndef PRIMS_H_
 #define PRIMS_H_
 
+#include <stdint.h>
+
 #include "type.h"
 
 #define F0(x) lt *x(void);
@@ -15,6 +17,11 @@
 #define F2(x) lt *x(lt *, lt *);
 #define F3(x) lt *x(lt *, lt *, lt *);
 
+extern int write_instruction(lt *, intptr_t *, lt *);
+extern int type_of(lt *);
+extern intptr_t pred_mask(lt *);
+extern lt *compile_signature(lt *);
+extern lt *mask_pred(intptr_t);
 extern void write_object(lt *, lt *);
 extern void write_raw_char(char, lt *);
 extern void write_raw_string(char *, lt *);
@@ -24,6 +31,10 @@ extern void writef(lt *, const char *, ...);
 extern F1(lt_nt_level);
 /** Fixnum **/
 extern F1(lt_fx2fp);
+extern F2(lt_g_add2);
+extern F2(lt_g_eq2);
+extern F2(lt_g_mul2);
+extern F2(lt_g_sub2);
 extern F2(lt_fx_add);
 extern F2(lt_fx_div);
 extern F2(lt_fx_eq);
@@ -44,6 +55,8 @@ extern F1(lt_char_code);
 extern F1(lt_code_char);
 extern F1(lt_read_char);
 extern F1(lt_read_line);
+/* Exception */
+extern F1(lt_exception_backtrace);
 /* Output File */
 extern F1(lt_close_out);
 /* List */
@@ -76,7 +89,7 @@ extern F1(lt_vector_to_list);
 extern F2(lt_eq);
 extern F2(lt_eql);
 extern F2(lt_equal);
-extern F0(lt_object_size);
+extern F1(lt_object_size);
 extern F1(lt_type_of);
 extern F1(lt_is_constant);
 extern F2(lt_is_kind_of);
@@ -18,6 +18,8 @@ int main(int argc, char *argv[])
 {
   char *inputs[] = {
       "(multiple-value-list ((lambda () (values 1 2 3))))",
+      "(if (= 1 2) (bin+ 1 2) (begin 3 (char-code #\\a)))",
+      "(type-name (type-of (signal \"x\")))",
   };
   init_global_variable();
   init_prims();
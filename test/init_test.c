@@ -62,6 +62,8 @@ int main(int argc, char *argv[])
       "(remove \"a\" '(\"a\" 1 2 \"a\"))",
       "(try-catch (/ 1 0) (error (e) -1))",
       "(+ 1 (+ 2 (try-catch (/ 1 0) (error (e) 3))))",
+      "(try-catch 5 (error (e) 1))",
+      "(try-catch (try-catch (signal \"in\") (other (e) 2)) (error (e) 3))",
       "(vector-last [1 2 3])",
 //      "(function-arity fx+)",
       "(function-arity bin+)",
@@ -75,6 +77,9 @@ int main(int argc, char *argv[])
       "(nth '(1 2 3) 1)",
       "(nthtail '(1 2 3) 0)",
       "(nthtail '(1 2 3) 1)",
+      "(gcd 832040 514229)",
+      "((lambda (x . r) r) 1 2 3)",
+      "(let ((s 0)) (dotimes (i 4) (set! s (+ s i))) s)",
       "(symbol-package (intern \"foobar\" \"Lisp\"))",
       "(reverse '())",
       "(reverse '(1))",
@@ -84,6 +89,7 @@ int main(int argc, char *argv[])
   };
   init_global_variable();
   init_prims();
+  init_primitive_opcode();
   init_macros();
   char *load_expr = "(load \"init.scm\")";
   lt *expr = read_object_from_string(strdup(load_expr));
@@ -95,6 +101,7 @@ int main(int argc, char *argv[])
     writef(standard_out, "%?\n", expr);
   else
     writef(standard_out, "=> %?\n", expr);
+  record_op4prim_functions();
   for (int i = 0; i < sizeof(inputs) / sizeof(char *); i++) {
     writef(standard_out, ">> %s\n", import_C_string(inputs[i]));
     lisp_object_t *expr = read_object_from_string(strdup(inputs[i]));
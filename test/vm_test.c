@@ -16,20 +16,167 @@
 #include "utilities.h"
 #include "vm.h"
 
+// Whether the disassembled code of the global function `name' contains `ins'
+int is_in_code(char *name, char *ins) {
+  char *text;
+  size_t size;
+  FILE *stream = open_memstream(&text, &size);
+  writef(make_output_port(stream), "%?", symbol_value(S(name)));
+  fclose(stream);
+  return strstr(text, ins) != NULL;
+}
+
 int main(int argc, char *argv[])
 {
-  char *inputs[] = {
-      "((lambda () (values 1 2 3)))",
-      "(multiple-value-list ((lambda () (values 1 2 3))))",
+// Each input is followed by the printed form of the value it should evaluate to,
+// or NULL if the value is not checked
+  char *inputs[][2] = {
+      {"((lambda () (values 1 2 3)))", "1"},
+      {"(multiple-value-list ((lambda () (values 1 2 3))))", "(1 2 3)"},
+      {"(multiple-value-bind (a b c) ((lambda () (values 1 2))) (list a b c))", "(1 2 ())"},
+      {"((lambda (n) (let ((f (lambda () (set! n (+ n 1)) n))) (f) (f))) 5)", "7"},
+      {"(multiple-value-list (let ((a 1)) (values a 2)))", "(1 2)"},
+//      A comparison followed by a branch is fused into one instruction
+      {"(define fused-less (a b) (if (< a b) (quote yes) (quote no)))", NULL},
+      {"(fused-less 1 2)", "yes"},
+      {"(fused-less 2 1)", "no"},
+      {"(fused-less 1.5 2)", "yes"},
+//      Inlining, and compiling again the functions after the inlined ones change
+      {"(switch-inline)", "#t"},
+      {"(define inc (x) (+ x 1))", NULL},
+      {"(define use-inc (y) (inc y))", NULL},
+      {"(use-inc 1)", "2"},
+      {"(define is-empty (l) (null? l))", NULL},
+      {"(is-empty '())", "#t"},
+      {"(is-empty '(1))", "#f"},
+      {"(define inc (x) (+ x 2))", NULL},
+      {"(use-inc 1)", "3"},
+      {"(switch-inline)", "#f"},
+//      The arguments are checked against the types of the signatures
+      {"((lambda (x) (type-name x)) (type-of 1))", "fixnum"},
+      {"((lambda (x) (try-catch (type-name x) (type-error (e) 'type-error))) 1)", "type-error"},
+      {"((lambda (x) (bound? x)) 'type-name)", "#t"},
+      {"((lambda (x) (try-catch (bound? x) (type-error (e) 'type-error))) \"a\")", "type-error"},
+//      The names of the special forms are only special at the head of a form
+      {"(define special-forms (x) (if x (begin (set! x 'set) (let ((y x)) y)) (lambda () 'fn)))", NULL},
+      {"(special-forms #t)", "set"},
+      {"(list 'if 'quote 'lambda)", "(if quote lambda)"},
+      {"'(if 1 2)", "(if 1 2)"},
+//      Long bodies and argument lists
+      {"(eval (cons 'begin (let ((l '())) (dotimes (i 1000) (set! l (cons i l))) l)))", "0"},
+      {"(head (eval (cons 'list (let ((l '())) (dotimes (i 1000) (set! l (cons i l))) l))))", "999"},
+//      Tagbodies in the same code may use the same tags
+      {"(let ((n 0)) (tagbody top (set! n (+ n 1)) (if (< n 3) (goto top))) (tagbody top (set! n (+ n 10)) (if (< n 30) (goto top))) n)", "33"},
+//      The symbols made by gensym are not interned
+      {"(let ((g (gensym))) (eq? g (intern (symbol-name g) \"User\")))", "#f"},
+      {"(eq? (gensym) (gensym))", "#f"},
+//      Hash tables: overwriting, removing, probing past the removed keys and growing
+      {"(let ((h (make-hash-table 'eq?))) (hash-table-put! h 'a 1) (hash-table-put! h 'a 2) (list (hash-table-get h 'a 0) (hash-table-count h)))", "(2 1)"},
+      {"(let ((h (make-hash-table 'eq?))) (hash-table-put! h 'a 1) (list (hash-table-remove! h 'a) (hash-table-remove! h 'a) (hash-table-get h 'a 'none) (hash-table-count h)))", "(#t #f none 0)"},
+      {"(let ((h (make-hash-table 'eql?)) (n 0)) (dotimes (i 1000) (hash-table-put! h i (* i i))) (dotimes (i 500) (hash-table-remove! h (* i 2))) (dotimes (i 1000) (if (eql? (hash-table-get h i 'none) (if (= (mod i 2) 0) 'none (* i i))) (set! n (+ n 1)))) (list (hash-table-count h) n))", "(500 1000)"},
+      {"(let ((h (make-hash-table 'eql?))) (dotimes (i 100) (hash-table-put! h i i)) (dotimes (i 100) (hash-table-remove! h i)) (dotimes (i 100) (hash-table-put! h (+ i 100) i)) (list (hash-table-count h) (hash-table-get h 150 'none) (hash-table-get h 50 'none)))", "(100 50 none)"},
+      {"(let ((h (make-hash-table 'eql?))) (hash-table-put! h 1.5 'a) (hash-table-get h 1.5 'none))", "a"},
+      {"(let ((h (make-hash-table 'equal?))) (dotimes (i 200) (hash-table-put! h (list i (+ i 1)) i)) (hash-table-put! h (list 7 8) 'seven) (hash-table-remove! h (list 9 10)) (list (hash-table-count h) (hash-table-get h (list 7 8) 'none) (hash-table-get h (list 9 10) 'none) (hash-table-get h (list 199 200) 'none)))", "(199 seven none 199)"},
+//      Characters are immediate, so equal characters are eq?
+      {"((lambda (n) (eq? (code-char n) #\\a)) 97)", "#t"},
+      {"((lambda (n) (char-code (code-char n))) 955)", "955"},
+//      Floats are doubles, and immediate in the common range
+      {"((lambda (x y) (bin+ x y)) 0.1 0.2)", "0.30000000000000004"},
+      {"((lambda (x y) (eq? x y)) 1.5 1.5)", "#t"},
+//      Integers are promoted to bignums past the range of fixnums, and demoted back
+      {"((lambda (x) (+ x 1)) 2305843009213693951)", "2305843009213693952"},
+      {"(bignum? ((lambda (x) (+ x 1)) 2305843009213693951))", "#t"},
+      {"(bignum? 2305843009213693951)", "#f"},
+      {"((lambda (x) (- x 1)) -2305843009213693952)", "-2305843009213693953"},
+      {"((lambda (x) (* x x)) 4294967296)", "18446744073709551616"},
+      {"(bin* 3037000500 -3037000500)", "-9223372037000250000"},
+      {"((lambda (x) (- x 1)) 2305843009213693952)", "2305843009213693951"},
+      {"(bignum? ((lambda (x) (- x 1)) 2305843009213693952))", "#f"},
+      {"(bignum? (bin- (bin+ 2305843009213693951 1) 1))", "#f"},
+      {"(let ((h (make-hash-table 'eql?))) (hash-table-put! h 2305843009213693952 'b) (hash-table-get h (+ 2305843009213693951 1) 'none))", "b"},
+//      Negative literals
+      {"-5", "-5"},
+      {"(bin+ -5 3)", "-2"},
+      {"(< -1 0)", "#t"},
+      {"(bignum? -2305843009213693952)", "#f"},
+      {"(bignum? -2305843009213693953)", "#t"},
+      {"-1.5", "-1.5"},
+      {"(type-name (type-of '-))", "symbol"},
+//      Bignums updated in place
+      {"(let ((n (fixnum->bignum 1))) (dotimes (i 3) (bignum-mul! n 1000000000)) n)", "1000000000000000000000000000"},
+      {"(let ((n (fixnum->bignum 2305843009213693951))) (bignum-add! n 2305843009213693951) (bignum-add! n (fixnum->bignum 2)) n)", "4611686018427387904"},
+      {"(try-catch (bignum-add! 1 1) (type-error (e) 'type-error))", "type-error"},
+//      The type of x is not known after it is assigned
+      {"(define id (y) y)", NULL},
+      {"(define code-char-of (x) (code-char x) (set! x (id \"a\")) (code-char x))", NULL},
+      {"(try-catch (code-char-of 97) (type-error (e) 'type-error))", "type-error"},
+//      A bignum made or updated in place is eql? to the fixnum of its value
+      {"(eql? (fixnum->bignum 5) 5)", "#t"},
+      {"(let ((n (fixnum->bignum 2305843009213693951))) (bignum-add! n 1) (bignum-add! n -1) (eql? n 2305843009213693951))", "#t"},
+      {"(let ((n (fixnum->bignum 1))) (dotimes (i 2) (bignum-mul! n 1000000000000)) (eql? n (* 1000000000000 1000000000000)))", "#t"},
+      {"(let ((h (make-hash-table 'eql?))) (hash-table-put! h 5 'five) (hash-table-get h (fixnum->bignum 5) 'none))", "five"},
+      {"(let ((h (make-hash-table 'eql?))) (hash-table-put! h (fixnum->bignum 5) 'five) (hash-table-get h 5 'none))", "five"},
+//      The arguments of the symbol primitives are checked
+      {"(try-catch (set-symbol-value! 1 2) (type-error (e) 'type-error))", "type-error"},
+      {"(try-catch (symbol-package \"a\") (type-error (e) 'type-error))", "type-error"},
+//      The values pushed within a tagbody are dropped by a goto out of them
+      {"((lambda (n) (let ((i 0)) (tagbody start (if (< i n) (let ((j 1)) (set! i (+ i j)) (goto start))) end) i)) 100000)", "100000"},
+      {"(let ((i 0)) (tagbody start (set! i (+ i 1)) (list 1 (if (< i 100000) (goto start) 2))) i)", "100000"},
+      {"(let ((i 0)) (tagbody start (set! i (+ i 1)) (if (< i 100000) (goto start))) i)", "100000"},
+//      An argument which may change before the parameter is used is bound to it
+      {"(switch-inline)", "#t"},
+      {"(define bump () (set! counter (+ counter 1)))", NULL},
+      {"(define bump-before (x) (list (bump) x))", NULL},
+      {"(set! counter 0)", "0"},
+      {"(define use-global () (bump-before counter))", NULL},
+      {"(use-global)", "(1 0)"},
+      {"(define use-boxed (n) (set! bump (lambda () (set! n (+ n 1)))) (bump-before n))", NULL},
+      {"(use-boxed 0)", "(1 0)"},
+      {"(switch-inline)", "#f"},
+//      The sum of a float and a bignum is an mpflonum, which is ordered as well
+      {"(type-name (type-of (bin+ 0.5 9876543210123456789)))", "mpflonum"},
+      {"(> (bin+ 0.5 9876543210123456789) 1)", "#t"},
+      {"(< (bin+ 0.5 9876543210123456789) 9876543210123456789)", "#f"},
+      {"(> (bin+ 0.5 9876543210123456789) 9876543210123456789)", "#t"},
+      {"(< 1.5 (bin- 0.5 9876543210123456789))", "#f"},
+      {"((lambda (x y) (< x y)) (bin+ 0.5 9876543210123456789) (bin+ 1.5 9876543210123456789))", "#t"},
+//      The functions having opcodes are called after their names are redefined
+      {"(define less (a b) (if (< a b) 'yes 'no))", NULL},
+      {"(set! saved-< <)", NULL},
+      {"(set! < >)", NULL},
+      {"(less 1 2)", "no"},
+      {"(< 1 2)", "#f"},
+      {"(set! < saved-<)", NULL},
+      {"(less 1 2)", "yes"},
+      {"(define add (a b) (bin+ a b))", NULL},
+      {"(set! bin+ (lambda (a b) 'redef))", NULL},
+      {"(bin+ 1 2)", "redef"},
+      {"(add 1 2)", "redef"},
+//      A call is not folded when the primitive function is redefined
+      {"(set! saved-eql? eql?)", NULL},
+      {"(set! eql? equal?)", NULL},
+      {"(define folded () (eql? '(1) '(1)))", NULL},
+      {"(set! eql? saved-eql?)", NULL},
+      {"(folded)", "#f"},
+  };
+// Each function is followed by an instruction, and whether it is in the code
+  struct { char *name; char *ins; int is_in; } codes[] = {
+      {"fused-less", " LT_FJUMP ", TRUE},
+      {"fused-less", " LVAR_LVAR ", TRUE},
+      {"use-inc", " GCALL ", FALSE},
+      {"is-empty", " GCALL ", FALSE},
+      {"is-empty", " EQ ", TRUE},
+      {"folded", " GPRIM ", TRUE},
   };
+  int failures = 0;
   init_global_variable();
   init_prims();
   init_primitive_opcode();
   init_macros();
   load_init_file();
-  for (int i = 0; i < sizeof(inputs) / sizeof(char *); i++) {
-    writef(standard_out, "%s >> %s\n", package_name(package), import_C_string(inputs[i]));
-    lisp_object_t *expr = read_object_from_string(strdup(inputs[i]));
+  for (int i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+    writef(standard_out, "%s >> %s\n", package_name(package), import_C_string(inputs[i][0]));
+    lisp_object_t *expr = read_object_from_string(strdup(inputs[i][0]));
     expr = compile_to_bytecode(expr);
     if (!is_signaled(expr))
       expr = run_by_llam(expr);
@@ -37,6 +184,19 @@ int main(int argc, char *argv[])
       writef(standard_out, "%?\n", expr);
     else
       writef(standard_out, "=> %?\n", expr);
+    if (inputs[i][1] == NULL)
+      continue;
+    lt *expected = read_object_from_string(strdup(inputs[i][1]));
+    if (is_signaled(expr) || isfalse(lt_equal(expr, expected))) {
+      writef(standard_out, "FAIL: expected %?\n", expected);
+      failures++;
+    }
   }
-  return 0;
+  for (int i = 0; i < sizeof(codes) / sizeof(codes[0]); i++)
+    if (is_in_code(codes[i].name, codes[i].ins) != codes[i].is_in) {
+      writef(standard_out, "FAIL: %s in the code of %s\n",
+             import_C_string(codes[i].ins), import_C_string(codes[i].name));
+      failures++;
+    }
+  return failures > 0;
 }
@@ -22,6 +22,8 @@ typedef lt *(*f0)(void);
 typedef lt *(*f1)(lt *);
 typedef lt *(*f2)(lt *, lt *);
 typedef lt *(*f3)(lt *, lt *, lt *);
+typedef struct frame_t frame_t;
+typedef struct handler_t handler_t;
 typedef struct string_builder_t string_builder_t;
 
 enum {
@@ -42,12 +44,15 @@ enum TYPE {
   LT_TCLOSE,
   LT_TEOF,
   LT_TUNDEF,
+  LT_UNICODE,
   /* tagged-union */
   LT_BIGNUM,
+  LT_CODE,
   LT_ENVIRONMENT,
   LT_EXCEPTION,
   LT_FUNCTION,
   LT_FLOAT,
+  LT_HASH_TABLE,
   LT_INPUT_PORT,
   LT_MPFLONUM,
   LT_OPCODE,
@@ -55,43 +60,85 @@ enum TYPE {
   LT_PACKAGE,
   LT_PAIR,
   LT_PRIMITIVE,
-  LT_RETADDR,
   LT_STRING,
   LT_STRUCT,
   LT_SYMBOL,
   LT_TIME,
   LT_TYPE,
-  LT_UNICODE,
   LT_VECTOR,
 };
 
+// The special forms named by the symbols, which are compiled specially
+enum FORM_TYPE {
+  NOT_SPECIAL_FORM,
+  BEGIN_FORM,
+  CATCH_FORM,
+  GOTO_FORM,
+  IF_FORM,
+  LAMBDA_FORM,
+  LET_FORM,
+  MVBIND_FORM,
+  MVL_FORM,
+  QUOTE_FORM,
+  RETURN_FORM,
+  SET_FORM,
+  TAGBODY_FORM,
+  VALUES_FORM,
+};
+
 enum OPCODE_TYPE {
+  BCSET,
+  BCVAR,
+  BLSET,
+  BLVAR,
+  BOX,
   CALL,
   CATCH,
-  CHECKEX,
-  CHKARITY,
   CHKTYPE,
   CONST,
-  CUTSTACK,
-  EXTENV,
+  CSET,
+  CVAR,
   FN,
+  GCALL,
+  GPRIM,
   GSET,
+  GTCALL,
   GVAR,
   FJUMP,
+  HALT,
   JUMP,
+  LOCALS,
   LSET,
   LVAR,
-  MOVEARGS,
+  MVBIND,
+  MVCALL,
   MVLIST,
+  MVSLIDE,
   POP,
-  POPENV,
   PRIM,
-  RESTARGS,
   RETURN,
-  SETMV,
+  SLIDE,
+  TCALL,
   VALUES,
 //  Primitive Function Instructions
   CONS,
+  EQ,
+  ADD,
+  SUB,
+  MUL,
+  NUMEQ,
+  GT,
+  LT,
+//  Superinstructions
+  CONST_GPRIM,
+  FJUMP_LVAR,
+  GT_FJUMP,
+  LT_FJUMP,
+  LVAR_CONST,
+  LVAR_GCALL,
+  LVAR_GPRIM,
+  LVAR_LVAR,
+  NUMEQ_FJUMP,
 };
 
 struct lisp_object_t {
@@ -100,25 +147,54 @@ struct lisp_object_t {
     struct {
       mpz_t value;
     } bignum;
+//    length: The number of words in stream
+//    stream: The instructions, each one is an opcode word followed by its operands inline
+//    constants: The constant pool indexed by the operands of kind `c'
+//    max_stack: The maximum depth of operand stack reached while running the code
+//    handlers: The regions protected by `catch' forms, in the order of their beginnings
+    struct {
+      int length, max_stack, nhandlers;
+      intptr_t *stream;
+      lt **constants;
+      handler_t *handlers;
+    } code;
     struct {
       lt *bindings;
       lt *next;
     } environment;
+//    frames: The frames unwound by the exception, from which the rest of backtrace
+//            is built when it is inspected
     struct {
-      int signal_flag;
+      int signal_flag, nframes;
       char *message;
       lt *backtrace;
       lt *exception_tag;
+      frame_t *frames;
     } exception;
     struct {
-      float value;
+      double value;
     } float_num;
+//    nrequired: The number of required parameters
+//    restp: Whether the parameters list ends with a rest parameter
+//    frame_size: The number of stack slots taken by the parameters on each call
+//    env: The values of the free variables copied into the closure. For the
+//         prototype referenced by FN, it describes where to copy them from
+//    body: The source of the body of a lambda at top-level, or undef. It is used
+//          for inlining the function and compiling it again
     struct {
       lt *code;
       lt *env;
       lt *args;
       lt *name;
+      lt *body;
+      int nrequired, restp, frame_size;
     } function;
+//    table: The keys and values, which are hashed and compared according to test
+//    test: The name of the predicate for comparing keys, which is eq?, eql? or equal?
+    struct {
+      hash_table_t *table;
+      lt *test;
+    } hash_table;
     struct {
       mpf_t value;
     } mpflonum;
@@ -127,6 +203,7 @@ struct lisp_object_t {
       int length;
       char *op;
       lt **oprands;
+      char *format;
     } opcode;
     struct {
       lt *name;
@@ -141,28 +218,16 @@ struct lisp_object_t {
       int colnum, linum, openp;
       FILE *stream;
     } port;
+//    return_type: The type of the values returned, or undef if it is not declared
     struct {
       int arity;
       int restp;
       char *Lisp_name;
       void *C_function;
       lt *signature;
+      lt *return_type;
     } primitive;
     struct {
-//      pc: The index of instructions executed before entering the instructions of callee
-//      throw_flag: Indicates whether the current callee should throws the exception or not
-//      code: The bytecode instructions of the last caller
-//      env: The environment of the last caller
-//      fn: The current callee. Use for two purposes
-//          1. Use for constructing function calling chain when throwing exception
-//          2. Stores the function to be used when modify its code pointer in the `yield' form
-//      req: The number of return values required by caller
-      int pc, throw_flag, req, is_multi, nvalues;
-      lt *code;
-      lt *env;
-      lt *fn;
-    } retaddr;
-    struct {
       int length;
       uint32_t *value;
     } string;
@@ -170,11 +235,17 @@ struct lisp_object_t {
       lt *name;
       lt *data;
     } structure;
+//    dependents: The names of the functions into which the global function is inlined
+//    form: The special form named by the symbol, looked up once when compiling a list
+//    gensym: The number of a symbol made by gensym, whose name is NULL until needed
     struct {
       char *name;
       lt *global_value;
       lt *macro;
       lt *package;
+      lt *dependents;
+      enum FORM_TYPE form;
+      int gensym;
     } symbol;
     struct {
       struct tm *value;
@@ -183,9 +254,6 @@ struct lisp_object_t {
       enum TYPE tag;
       char *name;
     } type;
-    struct {
-      uint32_t value;
-    } unicode;
     struct {
       int last, length;
       lt **value;
@@ -193,6 +261,27 @@ struct lisp_object_t {
   } u;
 };
 
+//  ip: The instruction to be executed after returning to the caller
+//  code: The bytecode of the caller
+//  closure: The values of the free variables of the caller
+//  fn: The callee, used for constructing the function calling chain when throwing exception
+//  is_multi: Whether all the values returned by the callee are wanted, followed by their count
+//  base: The index of the first local variable slot of the caller
+struct frame_t {
+  intptr_t *ip;
+  lt *code;
+  lt *closure;
+  lt *fn;
+  int is_multi, base;
+};
+
+//  start, end: The offsets of the instructions protected by the handler
+//  handler: The offset of the instruction receiving the exception
+//  depth: The depth of operand stack, relative to the frame, when entering the region
+struct handler_t {
+  int start, end, handler, depth;
+};
+
 struct string_builder_t {
   int index, length;
   char *string;
@@ -204,44 +293,85 @@ struct string_builder_t {
 /* tagging system
  *   bits end in  00:  pointer
  *                01:  fixnum
+ *                11:  float, whose exponent is in the range of FLOAT_EXPONENT_MIN
+ *                     to FLOAT_EXPONENT_MAX, or zero. It is stored in the rest bits
+ *                     rotated left by one bit with the exponent rebased, so the
+ *                     two high bits of exponent dropped are always zero.
+ *                     The floats out of the range are boxed.
+ *              0010:  character, whose code point is in the rest bits
  *              0110:  byte
  *              1110:  other immediate object (null_list, true, false, eof, undef, close)
  */
 #define BYTE_BITS 4
 #define BYTE_MASK 15
 #define BYTE_TAG 6
+#define CHAR_BITS 4
+#define CHAR_MASK 15
+#define CHAR_TAG 2
 #define FIXNUM_BITS 2
 #define FIXNUM_MASK 3
 #define FIXNUM_TAG 1
+#define FLOAT_BITS 2
+#define FLOAT_MASK 3
+#define FLOAT_TAG 3
+#define FLOAT_EXPONENT_MIN 769
+#define FLOAT_EXPONENT_MAX 1279
 #define IMMEDIATE_BITS 4
 #define IMMEDIATE_MASK 15
 #define IMMEDIATE_TAG 14
 #define POINTER_MASK 3
 #define POINTER_TAG 0
 
+/* type masks
+ *   A type predicate is represented by a mask with the bits indexed by the
+ *   types in `enum TYPE' set, whose instances satisfy the predicate.
+ */
+#define TYPE_BIT(type) ((intptr_t)1 << (type))
+#define ALL_TYPES_MASK ((TYPE_BIT(LT_VECTOR) << 1) - 1)
+
 #define byte_value(x) (((intptr_t)x) >> BYTE_BITS)
 #define fixnum_value(x) (((intptr_t)(x)) >> FIXNUM_BITS)
+// The range of the integers represented by fixnums, which take all the bits of
+// a word except the tag
+#define FIXNUM_MAX (INTPTR_MAX >> FIXNUM_BITS)
+#define FIXNUM_MIN (INTPTR_MIN >> FIXNUM_BITS)
+#define is_fixnum_value(n) (FIXNUM_MIN <= (n) && (n) <= FIXNUM_MAX)
 
 /* Accessor macros */
 #define _type_of_(x) ((x)->type)
 
 #define bignum_value(x) ((x)->u.bignum.value)
+#define code_constants(x) ((x)->u.code.constants)
+#define code_handlers(x) ((x)->u.code.handlers)
+#define code_length(x) ((x)->u.code.length)
+#define code_max_stack(x) ((x)->u.code.max_stack)
+#define code_nhandlers(x) ((x)->u.code.nhandlers)
+#define code_stream(x) ((x)->u.code.stream)
 #define environment_bindings(x) ((x)->u.environment.bindings)
 #define environment_next(x) ((x)->u.environment.next)
 #define exception_msg(x) ((x)->u.exception.message)
 #define exception_flag(x) ((x)->u.exception.signal_flag)
+#define exception_frames(x) ((x)->u.exception.frames)
+#define exception_nframes(x) ((x)->u.exception.nframes)
 #define exception_backtrace(x) ((x)->u.exception.backtrace)
 #define exception_tag(x) ((x)->u.exception.exception_tag)
-#define float_value(x) ((x)->u.float_num.value)
+#define boxed_float_value(x) ((x)->u.float_num.value)
 #define function_args(x) ((x)->u.function.args)
+#define function_body(x) ((x)->u.function.body)
 #define function_code(x) ((x)->u.function.code)
 #define function_env(x) ((x)->u.function.env)
+#define function_frame_size(x) ((x)->u.function.frame_size)
 #define function_name(x) ((x)->u.function.name)
+#define function_nrequired(x) ((x)->u.function.nrequired)
+#define function_restp(x) ((x)->u.function.restp)
+#define hash_table_table(x) ((x)->u.hash_table.table)
+#define hash_table_test(x) ((x)->u.hash_table.test)
 #define input_port_colnum(x) ((x)->u.port.colnum)
 #define input_port_stream(x) ((x)->u.port.stream)
 #define input_port_linum(x) ((x)->u.port.linum)
 #define input_port_openp(x) ((x)->u.port.openp)
 #define mpflonum_value(x) ((x)->u.mpflonum.value)
+#define opcode_format(x) ((x)->u.opcode.format)
 #define opcode_length(x) ((x)->u.opcode.length)
 #define opcode_name(x) ((x)->u.opcode.name)
 #define opcode_op(x) ((x)->u.opcode.op)
@@ -260,25 +390,22 @@ struct string_builder_t {
 #define primitive_func(x) ((x)->u.primitive.C_function)
 #define primitive_signature(x) ((x)->u.primitive.signature)
 #define primitive_restp(x) ((x)->u.primitive.restp)
-#define retaddr_code(x) ((x)->u.retaddr.code)
-#define retaddr_env(x) ((x)->u.retaddr.env)
-#define retaddr_fn(x) ((x)->u.retaddr.fn)
-#define retaddr_is_multi(x) ((x)->u.retaddr.is_multi)
-#define retaddr_nvalues(x) ((x)->u.retaddr.nvalues)
-#define retaddr_pc(x) ((x)->u.retaddr.pc)
-#define retaddr_throw_flag(x) ((x)->u.retaddr.throw_flag)
+#define primitive_return_type(x) ((x)->u.primitive.return_type)
 #define string_length(x) ((x)->u.string.length)
 #define string_value(x) ((x)->u.string.value)
 #define structure_name(x) ((x)->u.structure.name)
 #define structure_data(x) ((x)->u.structure.data)
 #define symbol_name(x) ((x)->u.symbol.name)
+#define symbol_dependents(x) ((x)->u.symbol.dependents)
+#define symbol_form(x) ((x)->u.symbol.form)
+#define symbol_gensym(x) ((x)->u.symbol.gensym)
 #define symbol_macro(x) ((x)->u.symbol.macro)
 #define symbol_package(x) ((x)->u.symbol.package)
 #define symbol_value(x) ((x)->u.symbol.global_value)
 #define time_value(x) ((x)->u.time.value)
 #define type_tag(x) ((x)->u.type.tag)
 #define type_name(x) ((x)->u.type.name)
-#define unicode_data(x) ((x)->u.unicode.value)
+#define unicode_data(x) ((uint32_t)(((intptr_t)x) >> CHAR_BITS))
 #define vector_last(x) ((x)->u.vector.last)
 #define vector_length(x) (x->u.vector.length)
 #define vector_value(x) (x->u.vector.value)
@@ -289,28 +416,37 @@ struct string_builder_t {
 #define oparg1(x) opargn(x, 0)
 #define oparg2(x) opargn(x, 1)
 #define oparg3(x) opargn(x, 2)
+#define op_box_var(x) oparg1(x)
 #define op_call_arity(x) oparg1(x)
-#define op_chkarity_arity(x) oparg1(x)
+#define op_catch_label(x) oparg1(x)
 #define op_chktype_pos(x) oparg1(x)
 #define op_chktype_type(x) oparg2(x)
 #define op_chktype_nargs(x) oparg3(x)
 #define op_const_value(x) oparg1(x)
-#define op_extenv_count(x) oparg1(x)
+#define op_cset_index(x) oparg1(x)
+#define op_cset_var(x) oparg2(x)
+#define op_cvar_index(x) oparg1(x)
+#define op_cvar_var(x) oparg2(x)
 #define op_fjump_label(x) oparg1(x)
 #define op_fn_func(x) oparg1(x)
+#define op_gcall_var(x) oparg1(x)
+#define op_gprim_var(x) oparg1(x)
 #define op_gset_var(x) oparg1(x)
+#define op_gtcall_var(x) oparg1(x)
 #define op_gvar_var(x) oparg1(x)
 #define op_jump_label(x) oparg1(x)
-#define op_lset_i(x) oparg1(x)
-#define op_lset_j(x) oparg2(x)
-#define op_lset_var(x) oparg3(x)
-#define op_lvar_i(x) oparg1(x)
-#define op_lvar_j(x) oparg2(x)
-#define op_lvar_var(x) oparg3(x)
-#define op_moveargs_count(x) oparg1(x)
+#define op_locals_vars(x) oparg1(x)
+#define op_lset_var(x) oparg1(x)
+#define op_lvar_var(x) oparg1(x)
+#define op_mvbind_count(x) oparg1(x)
+#define op_mvbind_label(x) oparg2(x)
+#define op_mvcall_arity(x) oparg1(x)
+#define op_mvlist_label(x) oparg1(x)
+#define op_mvslide_count(x) oparg1(x)
 #define op_prim_nargs(x) oparg1(x)
+#define op_slide_count(x) oparg1(x)
 // The number of required parameters.
-#define op_restargs_count(x) oparg1(x)
+#define op_tcall_arity(x) oparg1(x)
 #define op_values_count(x) oparg1(x)
 
 #endif /* TYPE_H_ */
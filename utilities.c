@@ -218,18 +218,13 @@ lt *mkopcode(enum OPCODE_TYPE name, int arity, ...) {
   return make_opcode(name, arity, opcode_op(opcode_ref(name)), oprands);
 }
 
-lisp_object_t *make_op_call(lisp_object_t *arity) {
-  assert(isfixnum(arity));
-  return mkopcode(CALL, 1, arity);
-}
-
-lt *make_op_checkex(void) {
-  return mkopcode(CHECKEX, 0);
+lt *make_op_box(lt *var) {
+  return mkopcode(BOX, 1, var);
 }
 
-lt *make_op_chkarity(lt *arity) {
+lisp_object_t *make_op_call(lisp_object_t *arity) {
   assert(isfixnum(arity));
-  return mkopcode(CHKARITY, 1, arity);
+  return mkopcode(CALL, 1, arity);
 }
 
 lt *make_op_chktype(lt *position, lt *target_type, lt *nargs) {
@@ -242,13 +237,14 @@ lisp_object_t *make_op_const(lisp_object_t *value) {
   return mkopcode(CONST, 1, value);
 }
 
-lt *make_op_cutstack(void) {
-  return mkopcode(CUTSTACK, 0);
+lt *make_op_cset(lt *index, lt *var) {
+  assert(isfixnum(index));
+  return mkopcode(CSET, 2, index, var);
 }
 
-lt *make_op_extenv(lt *count) {
-  assert(isfixnum(count));
-  return mkopcode(EXTENV, 1, count);
+lt *make_op_cvar(lt *index, lt *var) {
+  assert(isfixnum(index));
+  return mkopcode(CVAR, 2, index, var);
 }
 
 lisp_object_t *make_op_fjump(lisp_object_t *label) {
@@ -261,11 +257,26 @@ lisp_object_t *make_op_fn(lisp_object_t *func) {
   return mkopcode(FN, 1, func);
 }
 
+lt *make_op_gcall(lt *symbol) {
+  assert(is_lt_symbol(symbol));
+  return mkopcode(GCALL, 1, symbol);
+}
+
+lt *make_op_gprim(lt *symbol) {
+  assert(is_lt_symbol(symbol));
+  return mkopcode(GPRIM, 1, symbol);
+}
+
 lisp_object_t *make_op_gset(lisp_object_t *symbol) {
   assert(is_lt_symbol(symbol));
   return mkopcode(GSET, 1, symbol);
 }
 
+lt *make_op_gtcall(lt *symbol) {
+  assert(is_lt_symbol(symbol));
+  return mkopcode(GTCALL, 1, symbol);
+}
+
 lisp_object_t *make_op_gvar(lisp_object_t *symbol) {
   assert(is_lt_symbol(symbol));
   return mkopcode(GVAR, 1, symbol);
@@ -276,35 +287,42 @@ lisp_object_t *make_op_jump(lisp_object_t *label) {
   return mkopcode(JUMP, 1, label);
 }
 
-lt *make_op_lset(lt *i, lt *j, lt *symbol) {
-  assert(isfixnum(i));
-  assert(isfixnum(j));
-  assert(is_lt_symbol(symbol));
-  return mkopcode(LSET, 3, i, j, symbol);
+lt *make_op_locals(lt *vars) {
+  assert(is_lt_pair(vars) || isnull(vars));
+  return mkopcode(LOCALS, 1, vars);
 }
 
-lt *make_op_lvar(lt *i, lt *j, lt *symbol) {
-  assert(isfixnum(i));
-  assert(isfixnum(j));
-  assert(is_lt_symbol(symbol));
-  return mkopcode(LVAR, 3, i, j, symbol);
+lt *make_op_lset(lt *var) {
+  return mkopcode(LSET, 1, var);
+}
+
+lt *make_op_lvar(lt *var) {
+  return mkopcode(LVAR, 1, var);
 }
 
-lt *make_op_moveargs(lt *count) {
+lt *make_op_mvbind(lt *count, lt *label) {
   assert(isfixnum(count));
-  return mkopcode(MOVEARGS, 1, count);
+  assert(is_lt_symbol(label));
+  return mkopcode(MVBIND, 2, count, label);
 }
 
-lt *make_op_mvlist(void) {
-  return mkopcode(MVLIST, 0);
+lt *make_op_mvcall(lt *arity) {
+  assert(isfixnum(arity));
+  return mkopcode(MVCALL, 1, arity);
 }
 
-lisp_object_t *make_op_pop(void) {
-  return mkopcode(POP, 0);
+lt *make_op_mvlist(lt *label) {
+  assert(is_lt_symbol(label));
+  return mkopcode(MVLIST, 1, label);
+}
+
+lt *make_op_mvslide(lt *count) {
+  assert(isfixnum(count));
+  return mkopcode(MVSLIDE, 1, count);
 }
 
-lt *make_op_popenv(void) {
-  return mkopcode(POPENV, 0);
+lisp_object_t *make_op_pop(void) {
+  return mkopcode(POP, 0);
 }
 
 lisp_object_t *make_op_prim(lisp_object_t *nargs) {
@@ -316,13 +334,14 @@ lisp_object_t *make_op_return(void) {
   return mkopcode(RETURN, 0);
 }
 
-lt *make_op_restargs(lt *count) {
+lt *make_op_slide(lt *count) {
   assert(isfixnum(count));
-  return mkopcode(RESTARGS, 1, count);
+  return mkopcode(SLIDE, 1, count);
 }
 
-lt *make_op_setmv(void) {
-  return mkopcode(SETMV, 0);
+lt *make_op_tcall(lt *arity) {
+  assert(isfixnum(arity));
+  return mkopcode(TCALL, 1, arity);
 }
 
 lt *make_op_values(lt *count) {
@@ -330,12 +349,13 @@ lt *make_op_values(lt *count) {
   return mkopcode(VALUES, 1, count);
 }
 
-lt *make_op_catch(void) {
-  return mkopcode(CATCH, 0);
+lt *make_op_catch(lt *label) {
+  assert(is_lt_symbol(label));
+  return mkopcode(CATCH, 1, label);
 }
 
 int prim_comp_fn(void *p1, void *p2) {
-  return p1 - p2;
+  return string_comp_fn(p1, p2);
 }
 
 unsigned int prim_hash_fn(void *prim) {
@@ -346,25 +366,52 @@ hash_table_t *make_prim2op_map(void) {
   return make_hash_table(31, prim_hash_fn, prim_comp_fn);
 }
 
+// The value of a name in the map is the pair of its opcode and the function
+// the opcode stands for. The function is undefined until the name is bound.
 lt *search_op4prim(lt *prim) {
   assert(is_lt_symbol(prim));
-  return search_ht(symbol_name(prim), prim2op_map);
+  return search_ht(ensure_symbol_name(prim), prim2op_map);
 }
 
 void set_op4prim(char *prim, enum OPCODE_TYPE opcode) {
-  set_ht(prim, opcode_ref(opcode), prim2op_map);
+  lt *fn = symbol_value(LISP(prim));
+  set_ht(prim, make_pair(opcode_ref(opcode), fn), prim2op_map);
+}
+
+// Records the functions defined after the opcodes are set, like + in init.scm.
+void record_op4prim_functions(void) {
+  hash_table_t *ht = prim2op_map;
+  for (int i = ht_next_entry(ht, -1); i != -1; i = ht_next_entry(ht, i)) {
+    ht_entry_t *en = &ht_entries(ht)[i];
+    lt *op = en_value(en);
+    if (pair_tail(op) == the_undef)
+      pair_tail(op) = symbol_value(LISP(en_key(en)));
+  }
+}
+
+// Whether the global function of a name is still the one defined by the
+// system, so that a call to it can be compiled into an opcode or be folded.
+int is_original_fn(lt *prim) {
+  assert(is_lt_symbol(prim));
+  lt *fn = symbol_value(prim);
+  lt *op = search_op4prim(prim);
+  if (op != NULL)
+    return fn != the_undef && (pair_tail(op) == the_undef || fn == pair_tail(op));
+  return is_lt_primitive(fn) &&
+      strcmp(primitive_Lisp_name(fn), ensure_symbol_name(prim)) == 0;
 }
 
 int isopcode_fn(lt *prim) {
   assert(is_lt_symbol(prim));
-  return search_op4prim(prim) != NULL;
+  return search_op4prim(prim) != NULL && is_original_fn(prim);
 }
 
 lt *make_fn_inst(lt *prim) {
   assert(is_lt_symbol(prim));
-  lt *opcode = search_op4prim(prim);
-  assert(opcode != NULL);
-  return make_pair(mkopcode(opcode_name(opcode), 0), the_empty_list);
+  lt *op = search_op4prim(prim);
+  assert(op != NULL);
+  lt *opcode = pair_head(op);
+  return make_pair(mkopcode(opcode_name(opcode), 2, prim, symbol_value(prim)), the_empty_list);
 }
 
 /* Package */
@@ -465,7 +512,7 @@ int compute_field_offset(char *field_name, char *st_name) {
   int i = 0;
   while (is_lt_pair(fs)) {
     lt *field = pair_head(fs);
-    if (strcmp(symbol_name(field), field_name) == 0)
+    if (strcmp(ensure_symbol_name(field), field_name) == 0)
       return i;
     fs = pair_head(fs);
     i++;
@@ -494,7 +541,6 @@ hash_table_t *make_structures_table(void) {
 }
 
 /* Symbol */
-// The following algorithm comes from http://bbs.csdn.net/topics/350030230
 unsigned int symbol_hash_fn(void *symbol) {
   return string_hash_fn(symbol);
 }
@@ -537,23 +583,31 @@ lt *find_or_create_symbol(char *name, lt *package) {
 }
 
 /* Special Forms */
-#define deform_pred(func_name, symbol_name) \
+// Returns the special form of the list `form' by the mark on its head
+enum FORM_TYPE form_type(lt *form) {
+  if (is_lt_pair(form) && is_lt_symbol(pair_head(form)))
+    return symbol_form(pair_head(form));
+  return NOT_SPECIAL_FORM;
+}
+
+#define deform_pred(func_name, type) \
   int func_name(lt *form) { \
-    return is_tag_list(form, S(symbol_name)); \
+    return form_type(form) == type; \
   }
 
-deform_pred(is_begin_form, "begin")
-deform_pred(is_catch_form, "catch")
-deform_pred(is_goto_form, "goto")
-deform_pred(is_if_form, "if")
-deform_pred(is_lambda_form, "lambda")
-deform_pred(is_let_form, "let")
-deform_pred(is_mvl_form, "multiple-value-list")
-deform_pred(is_quote_form, "quote")
-deform_pred(is_return_form, "return")
-deform_pred(is_set_form, "set!")
-deform_pred(is_tagbody_form, "tagbody")
-deform_pred(is_values_form, "values")
+deform_pred(is_begin_form, BEGIN_FORM)
+deform_pred(is_catch_form, CATCH_FORM)
+deform_pred(is_goto_form, GOTO_FORM)
+deform_pred(is_if_form, IF_FORM)
+deform_pred(is_lambda_form, LAMBDA_FORM)
+deform_pred(is_let_form, LET_FORM)
+deform_pred(is_mvbind_form, MVBIND_FORM)
+deform_pred(is_mvl_form, MVL_FORM)
+deform_pred(is_quote_form, QUOTE_FORM)
+deform_pred(is_return_form, RETURN_FORM)
+deform_pred(is_set_form, SET_FORM)
+deform_pred(is_tagbody_form, TAGBODY_FORM)
+deform_pred(is_values_form, VALUES_FORM)
 
 lt *let_bindings(lt *form) {
   return pair_head(pair_tail(form));
@@ -42,32 +42,37 @@ extern uint32_t get_code_point(char *);
 /* Opcode */
 extern void set_op4prim(char *, enum OPCODE_TYPE);
 extern hash_table_t *make_prim2op_map(void);
+extern lt *make_op_box(lt *);
 extern lt *make_op_call(lt *);
-extern lt *make_op_checkex(void);
-extern lt *make_op_chkarity(lt *);
 extern lt *make_op_chktype(lt *, lt *, lt *);
 extern lt *make_op_const(lt *);
-extern lt *make_op_cutstack(void);
-extern lt *make_op_extenv(lt *);
+extern lt *make_op_cset(lt *, lt *);
+extern lt *make_op_cvar(lt *, lt *);
 extern lt *make_op_fjump(lt *);
 extern lt *make_op_fn(lt *);
+extern lt *make_op_gcall(lt *);
+extern lt *make_op_gprim(lt *);
 extern lt *make_op_gset(lt *);
+extern lt *make_op_gtcall(lt *);
 extern lt *make_op_gvar(lt *);
 extern lt *make_op_jump(lt *);
-extern lt *make_op_lset(lt *i, lt *j, lt *symbol);
-extern lt *make_op_lvar(lt *i, lt *j, lt *symbol);
-extern lt *make_op_moveargs(lt *);
-extern lt *make_op_mvlist(void);
+extern lt *make_op_locals(lt *);
+extern lt *make_op_lset(lt *);
+extern lt *make_op_lvar(lt *);
+extern lt *make_op_mvbind(lt *, lt *);
+extern lt *make_op_mvcall(lt *);
+extern lt *make_op_mvlist(lt *);
+extern lt *make_op_mvslide(lt *);
 extern lt *make_op_pop(void);
-extern lt *make_op_popenv(void);
 extern lt *make_op_prim(lt *);
-extern lt *make_op_restargs(lt *);
 extern lt *make_op_return(void);
-extern lt *make_op_setmv(void);
+extern lt *make_op_slide(lt *);
+extern lt *make_op_tcall(lt *);
 extern lt *make_op_values(lt *);
-extern lt *make_op_catch(void);
+extern lt *make_op_catch(lt *);
 extern lt *make_fn_inst(lt *);
 extern lt *search_op4prim(lt *);
+extern void record_op4prim_functions(void);
 
 /* Package */
 extern void use_package_in(lt *, lt *);
@@ -97,12 +102,14 @@ extern lt *find_or_create_symbol(char *, lt *);
 
 /* Special Forms */
 extern int is_tag_list(lt *list, lt *tag);
+extern enum FORM_TYPE form_type(lt *);
 extern int is_begin_form(lt *);
 extern int is_catch_form(lt *);
 extern int is_goto_form(lt *);
 extern int is_if_form(lt *);
 extern int is_lambda_form(lt *);
 extern int is_let_form(lt *);
+extern int is_mvbind_form(lt *);
 extern int is_mvl_form(lt *);
 extern int is_quote_form(lt *);
 extern int is_return_form(lt *);
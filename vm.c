@@ -7,391 +7,770 @@
  * This file contains the definition of the virtual machine
  */
 #include <assert.h>
+#include <gc/gc.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "compiler.h"
 #include "object.h"
 #include "prims.h"
 #include "type.h"
 #include "utilities.h"
+#include "vm.h"
 
-void add_local_variable(lt *var, lt *env) {
-  if (isnull_env(env))
-    return;
-  assert(is_lt_vector(environment_bindings(env)));
-  lt_vector_push_extend(environment_bindings(env), make_undef());
+int is_type_satisfy(lt *arg, intptr_t mask) {
+  return (TYPE_BIT(type_of(arg)) & mask) != 0;
 }
 
-lt *walk_in_env(lt *env, int n) {
-  assert(is_lt_environment(env));
-  while (n-- > 0)
-    env = environment_next(env);
-  return env;
+lt *type_error(lt *index, lt *pred) {
+  char msg[256];
+  FILE *buf = fmemopen(msg, sizeof(msg), "w");
+  lt *file = make_output_port(buf);
+  writef(file, "The argument at index %d is not satisfy with predicate %?", index, pred);
+  lt_close_out(file);
+  return make_exception(strdup(msg), TRUE, the_type_error_symbol, the_empty_list);
 }
 
-lisp_object_t *find_in_frame(lisp_object_t *bindings, int j) {
-  assert(is_lt_pair(bindings) || is_lt_vector(bindings));
-  if (is_lt_pair(bindings)) {
-    bindings = lt_raw_nthtail(bindings, j);
-    return pair_head(bindings);
-  } else if (is_lt_vector(bindings)) {
-    return vector_value(bindings)[j];
-  }
-  fprintf(stdout, "Impossible!!! variable not found!\n");
-  exit(1);
+// Tests whether the object is handled by the generic arithmetic operations
+int is_tower_number(lt *x) {
+  return isfixnum(x) || is_lt_float(x) || is_lt_bignum(x) || is_lt_mpflonum(x);
+}
+
+int is_arity_match(lt *fn, int nargs) {
+  int nrequired = function_nrequired(fn);
+  return nargs == nrequired || (nargs > nrequired && function_restp(fn));
 }
 
-lisp_object_t *locate_var(lisp_object_t *env, int i, int j) {
-  assert(is_lt_environment(env) || isnull_env(env));
-  env = walk_in_env(env, i);
-  return find_in_frame(environment_bindings(env), j);
+int is_primitive_arity_match(lt *prim, int nargs) {
+  if (primitive_restp(prim))
+    return nargs >= primitive_arity(prim) - 1;
+  else
+    return nargs == primitive_arity(prim);
 }
 
-lisp_object_t *raw_vector_ref(lisp_object_t *vector, int index) {
-  assert(is_lt_vector(vector));
-  return vector_value(vector)[index];
+// Copies the frames to a new array, which is twice as large if the old one is full.
+// The old array is left untouched since it may be referenced by an exception.
+frame_t *copy_frames(frame_t *frames, int nframes, int *size) {
+  if (nframes == *size)
+    *size *= 2;
+  frame_t *new_frames = GC_MALLOC(*size * sizeof(frame_t));
+  memcpy(new_frames, frames, nframes * sizeof(frame_t));
+  return new_frames;
 }
 
-void set_in_frame(lisp_object_t *bindings, int j, lisp_object_t *value) {
-  assert(is_lt_pair(bindings) || is_lt_vector(bindings));
-  if (is_lt_pair(bindings)) {
-    bindings = lt_raw_nthtail(bindings, j);
-    pair_head(bindings) = value;
-    return;
-  } else if (is_lt_vector(bindings)) {
-    vector_value(bindings)[j] = value;
-    return;
+// Returns the innermost handler protecting the instruction at `pc'
+handler_t *find_handler(lt *code, int pc) {
+  for (int i = code_nhandlers(code) - 1; i >= 0; i--) {
+    handler_t *handler = &code_handlers(code)[i];
+    if (handler->start <= pc && pc < handler->end)
+      return handler;
   }
-  fprintf(stdout, "Impossible!!! variable not found!\n");
-  exit(1);
+  return NULL;
 }
 
-void set_local_var(lisp_object_t *env, int i, int j, lisp_object_t *value) {
-  env = walk_in_env(env, i);
-  set_in_frame(environment_bindings(env), j, value);
+#ifdef THREADED_CODE
+// The addresses of the instruction handlers in `run_by_llam', indexed by opcode
+void **dispatch_table = NULL;
+#endif
+
+intptr_t vm_opcode_word(enum OPCODE_TYPE opcode) {
+#ifdef THREADED_CODE
+  if (dispatch_table == NULL)
+    run_by_llam(NULL);
+  return (intptr_t)dispatch_table[opcode];
+#else
+  return opcode;
+#endif
 }
 
-int is_type_satisfy(lt *arg, lt *pred) {
-  if (pred == S("object"))
-    return TRUE;
-  else if (is_lt_type(pred))
-    return !isfalse(lt_is_kind_of(arg, pred));
-  else if (is_tag_list(pred, S("or"))) {
-    lt *types = pair_tail(pred);
-    while (is_lt_pair(types)) {
-      lt *t = pair_head(types);
-      if (is_type_satisfy(arg, t) == TRUE)
-        return TRUE;
-      else
-        types = pair_tail(types);
-    }
-    return FALSE;
-  } else {
-    fprintf(stderr, "Unknown type predicate. Please check the signature declarations in function `init_prims' in file `prims.c'.\n");
-    exit(1);
-  }
+enum OPCODE_TYPE vm_word_opcode(intptr_t word) {
+#ifdef THREADED_CODE
+  if (dispatch_table == NULL)
+    run_by_llam(NULL);
+  for (int i = 0; i <= NUMEQ_FJUMP; i++)
+    if (dispatch_table[i] == (void *)word)
+      return i;
+  fprintf(stdout, "In vm_word_opcode --- Invalid instruction word %p\n", (void *)word);
+  exit(1);
+#else
+  return word;
+#endif
 }
 
-lt *type_error(lt *index, lt *pred) {
-  char msg[256];
-  FILE *buf = fmemopen(msg, sizeof(msg), "w");
-  lt *file = make_output_port(buf);
-  writef(file, "The argument at index %d is not satisfy with predicate %?", index, pred);
-  lt_close_out(file);
-  return make_exception(strdup(msg), TRUE, the_type_error_symbol, the_empty_list);
+// Enlarges the `array' of `*size' elements, each one is `width' bytes long, to
+// hold at least `needed' elements. The size is doubled for amortized O(1) growth.
+void *grow_array(void *array, int *size, int needed, size_t width) {
+  int new_size = *size * 2;
+  while (new_size < needed)
+    new_size *= 2;
+  *size = new_size;
+  return GC_realloc(array, new_size * width);
 }
 
-lt *comp2run_env(lt *comp_env, lt *next) {
-  lt *pars = environment_bindings(comp_env);
-  assert(is_lt_pair(pars) || isnull(pars));
-  int len = pair_length(pars);
-  return make_environment(make_vector(len), next);
+void write_stack(lt **stack, lt **sp, lt *dest) {
+  write_raw_char('[', dest);
+  for (lt **p = stack; p < sp; p++) {
+    if (p != stack)
+      write_raw_char(' ', dest);
+    write_object(*p, dest);
+  }
+  write_raw_char(']', dest);
 }
 
 lisp_object_t *run_by_llam(lisp_object_t *code_vector) {
-#define _arg(N) vlast(stack, primitive_arity(func) - N)
+#define _arg(N) (sp[N - primitive_arity(func) - 1])
 #define _arg1 _arg(1)
 #define _arg2 _arg(2)
 #define _arg3 _arg(3)
-#define move_stack() vector_last(stack) -= primitive_arity(func)
-#define vlast(v, n) lt_vector_last_nth(v, make_fixnum(n))
+#define move_stack() (sp -= primitive_arity(func))
+#define PUSH(x) (*sp++ = (x))
+#define POP() (*--sp)
+#define TOP(n) (sp[-1 - (n)])
+#define ensure_stack(n) \
+  if (sp + (n) > stack + stack_size) { \
+    int depth = sp - stack; \
+    stack = grow_array(stack, &stack_size, depth + (n), sizeof(lt *)); \
+    sp = stack + depth; \
+  }
+#define oprand(n) (ip[n])
+#define constant(n) (constants[ip[n]])
+#define jump_target(n) ((intptr_t *)ip[n])
+#define inline_cache(n) (*(lt **)&ip[n])
+#define local(n) (stack[base + ip[n]])
+#define trace() \
+  if (debug) { \
+    write_raw_string("stack is ", standard_out); \
+    write_stack(stack, sp, standard_out); \
+    write_raw_char('\n', standard_out); \
+    write_raw_string("ins is ", standard_out); \
+    write_instruction(code, ip, standard_out); \
+    write_raw_char('\n', standard_out); \
+  }
+
+#ifdef THREADED_CODE
+#define INS(name) ins_##name
+#define CASE(name) INS(name):
+#define DISPATCH() do { trace(); goto *(void *)*ip; } while (0)
+//  Continues with the instruction `n' words later, which is known to be `name'
+#define FALL_INTO(name, n) do { ip += (n); goto INS(name); } while (0)
 
-  lt *stack = make_vector(50);
+  static void *labels[] = {
+      [BCSET] = &&INS(BCSET),
+      [BCVAR] = &&INS(BCVAR),
+      [BLSET] = &&INS(BLSET),
+      [BLVAR] = &&INS(BLVAR),
+      [BOX] = &&INS(BOX),
+      [CALL] = &&INS(CALL),
+      [CHKTYPE] = &&INS(CHKTYPE),
+      [CONST] = &&INS(CONST),
+      [CSET] = &&INS(CSET),
+      [CVAR] = &&INS(CVAR),
+      [FN] = &&INS(FN),
+      [GCALL] = &&INS(GCALL),
+      [GPRIM] = &&INS(GPRIM),
+      [GSET] = &&INS(GSET),
+      [GTCALL] = &&INS(GTCALL),
+      [GVAR] = &&INS(GVAR),
+      [FJUMP] = &&INS(FJUMP),
+      [HALT] = &&INS(HALT),
+      [JUMP] = &&INS(JUMP),
+      [LSET] = &&INS(LSET),
+      [LVAR] = &&INS(LVAR),
+      [MVBIND] = &&INS(MVBIND),
+      [MVCALL] = &&INS(MVCALL),
+      [MVLIST] = &&INS(MVLIST),
+      [MVSLIDE] = &&INS(MVSLIDE),
+      [POP] = &&INS(POP),
+      [PRIM] = &&INS(PRIM),
+      [RETURN] = &&INS(RETURN),
+      [SLIDE] = &&INS(SLIDE),
+      [TCALL] = &&INS(TCALL),
+      [VALUES] = &&INS(VALUES),
+      [CONS] = &&INS(CONS),
+      [EQ] = &&INS(EQ),
+      [ADD] = &&INS(ADD),
+      [SUB] = &&INS(SUB),
+      [MUL] = &&INS(MUL),
+      [NUMEQ] = &&INS(NUMEQ),
+      [GT] = &&INS(GT),
+      [LT] = &&INS(LT),
+      [CONST_GPRIM] = &&INS(CONST_GPRIM),
+      [FJUMP_LVAR] = &&INS(FJUMP_LVAR),
+      [GT_FJUMP] = &&INS(GT_FJUMP),
+      [LT_FJUMP] = &&INS(LT_FJUMP),
+      [LVAR_CONST] = &&INS(LVAR_CONST),
+      [LVAR_GCALL] = &&INS(LVAR_GCALL),
+      [LVAR_GPRIM] = &&INS(LVAR_GPRIM),
+      [LVAR_LVAR] = &&INS(LVAR_LVAR),
+      [NUMEQ_FJUMP] = &&INS(NUMEQ_FJUMP),
+  };
+//  The assembler needs the addresses of handlers to build the threaded code
+  if (code_vector == NULL) {
+    dispatch_table = labels;
+    return NULL;
+  }
+#else
+#define CASE(name) case name:
+#define DISPATCH() do { trace(); goto dispatch; } while (0)
+#define FALL_INTO(name, n) NEXT(n)
+#endif
+#define NEXT(n) do { ip += (n); DISPATCH(); } while (0)
+//  The opcode of a function is run only while its global variable is bound to
+//  the function cached when compiling, otherwise the variable is called.
+#define CHECK_OP_FN() \
+  if (symbol_value(constant(1)) != inline_cache(2)) \
+    goto call_op_fn
+//  Computes `fxop' directly when both operands are fixnums, otherwise the generic
+//  operation `gop' is called if both operands satisfy `pred'.
+#define BINARY_OP(fxop, pred, gop) \
+  CHECK_OP_FN(); \
+  arg2 = POP(); \
+  arg1 = POP(); \
+  if (isfixnum(arg1) && isfixnum(arg2)) \
+    PUSH(fxop); \
+  else if (pred(arg1) && pred(arg2)) \
+    PUSH(gop); \
+  else { \
+    ex = signal_exception("The arguments of a numeric operation must be numbers"); \
+    goto raise; \
+  } \
+  NEXT(3)
+//  Computes the fixnum result into `fx' by `fxop', which is true if it overflows.
+//  The result out of the range of fixnums is computed by `gop' as a bignum.
+#define FIXNUM_OP(fxop, gop) \
+  CHECK_OP_FN(); \
+  arg2 = POP(); \
+  arg1 = POP(); \
+  if (isfixnum(arg1) && isfixnum(arg2) && !(fxop) && is_fixnum_value(fx)) \
+    PUSH(make_fixnum(fx)); \
+  else if (is_tower_number(arg1) && is_tower_number(arg2)) \
+    PUSH(gop); \
+  else { \
+    ex = signal_exception("The arguments of a numeric operation must be numbers"); \
+    goto raise; \
+  } \
+  NEXT(3)
+//  Jumps to the target of the FJUMP following the comparison if it is false,
+//  without pushing the boolean.
+#define COMPARE_JUMP(fxop, pred, gop) \
+  CHECK_OP_FN(); \
+  arg2 = POP(); \
+  arg1 = POP(); \
+  if (isfixnum(arg1) && isfixnum(arg2)) \
+    arg1 = booleanize(fxop); \
+  else if (pred(arg1) && pred(arg2)) \
+    arg1 = gop; \
+  else { \
+    ex = signal_exception("The arguments of a numeric operation must be numbers"); \
+    goto raise; \
+  } \
+  if (!isfalse(arg1)) \
+    NEXT(5); \
+  ip = jump_target(4); \
+  DISPATCH()
+
+//  The operand stack, `sp' points to the slot above the top
+  int stack_size = 64;
+  lt **stack = GC_MALLOC(stack_size * sizeof(lt *));
+  lt **sp = stack;
+//  The frames of the callers. New frames can be pushed until `frame_limit'
+  int frame_size = 16;
+  int frame_limit = frame_size;
+  int nframes = 0;
+  frame_t *frames = GC_MALLOC(frame_size * sizeof(frame_t));
+//  The index of the bottom of the current function's operand stack, where the
+//  arguments and the local variables are followed by the temporary values
+  int base = 0;
+//  The number of values moved to the caller's stack when returning
+  int nvals;
   lt *arg1;
   lt *arg2;
+  intptr_t fx;
+  lt *fn;
+//  The exception being raised
+  lt *ex;
 
-  assert(is_lt_vector(code_vector));
+  assert(is_lt_code(code_vector));
 //  The number of arguments passed.
   int nargs = 0;
-  int pc = 0;
-  int throw_exception = TRUE;
+//  Set by MVCALL for the callee to return all of its values
   int is_multi = FALSE;
-  int nvalues = 1;
   lt *code = code_vector;
-  lisp_object_t *env = null_env;
-  lt *prim = NULL;
-  lisp_object_t *return_stack = the_empty_list;
-  while (pc < vector_length(code)) {
-    lisp_object_t *ins = raw_vector_ref(code, pc);
-    if (debug)
-      writef(standard_out, "ins is %?\n", ins);
-    switch (opcode_type(ins)) {
-      case CALL: {
-        lisp_object_t *func = lt_vector_pop(stack);
-        if (is_lt_primitive(func)) {
-//        	This is possible because the first element of a application list
-//        	might be a compound expression, and this compound one will return
-//        	a primitive function object at run-time, but the compiler is unable
-//        	to generate a PRIM instruction at compile-time --- This is only
-//        	happen when the first element is a symbol named a primitive function.
-        	lt_vector_push(stack, func);
-        	goto call_primitive;
-        }
-        if (!is_lt_function(func)) {
-          char msg[1000];
-          FILE *fp = fmemopen(msg, sizeof(msg), "w");
-          lt *file = make_output_port(fp);
-          writef(file, "The object %? at the first place is not a function", func);
-          lt_close_out(file);
-          return signal_exception(msg);
-        }
-        lisp_object_t *retaddr =
-            make_retaddr(code, env, func, pc, throw_exception, vector_last(stack), is_multi);
-        return_stack = make_pair(retaddr, return_stack);
-        code = function_code(func);
-        env = function_env(func);
-        pc = -1;
-        throw_exception = TRUE;
-        nargs = fixnum_value(op_call_arity(ins));
-        env = comp2run_env(function_env(func), env);
-      }
-        break;
-      case CATCH:
-        throw_exception = FALSE;
-        lt_vector_push(stack, make_empty_list());
-        break;
-        check_exception:
-      case CHECKEX:
-        while (is_signaled(vlast(stack, 0)) && throw_exception) {
-          lt *ex = lt_vector_pop(stack);
-          if (isnull(return_stack)) {
-            if (prim != NULL)
-              exception_backtrace(ex) = list1(prim);
-            lt_vector_push(stack, ex);
-            goto halt;
-          }
-          lt *ret = pair_head(return_stack);
-          lt *fn = retaddr_fn(ret);
-          exception_backtrace(ex) = make_pair(fn, exception_backtrace(ex));
-          return_stack = pair_tail(return_stack);
-          code = retaddr_code(ret);
-          env = retaddr_env(ret);
-          pc = retaddr_pc(ret);
-          throw_exception = retaddr_throw_flag(ret);
-          lt_vector_push(stack, ex);
-        }
-        break;
-      case CHKARITY: {
-        int arity = fixnum_value(op_chkarity_arity(ins));
-        if (arity > nargs)
-          return signal_exception("CHKARITY - Too few arguments passed");
-        if (arity < nargs)
-          return signal_exception("CHKARITY - Too many arguments passed");
-      }
-        break;
-      case CHKTYPE: {
-        lt *index = op_chktype_pos(ins);
-        lt *pred = op_chktype_type(ins);
-        lt *nargs = op_chktype_nargs(ins);
-        lt *arg = vlast(stack, fixnum_value(nargs) - fixnum_value(index) - 1);
-        if (is_type_satisfy(arg, pred) == FALSE) {
-          return type_error(index, pred);
-        }
-      }
-        break;
-      case CONST:
-        lt_vector_push(stack, op_const_value(ins));
-        break;
-      case CUTSTACK:
-        if (!is_multi && nvalues > 1) {
-          for (int i = 0; i < nvalues - 1; i++)
-            lt_vector_pop(stack);
-        }
-        break;
-      case EXTENV: {
-        lt *length = op_extenv_count(ins);
-        env = make_environment(make_vector(fixnum_value(length)), env);
-      }
-        break;
-      case FJUMP:
-        if (isfalse(lt_vector_pop(stack)))
-          pc = fixnum_value(op_fjump_label(ins)) - 1;
-        break;
-      case FN: {
-        lisp_object_t *func = op_fn_func(ins);
-        func = make_function(function_args(func), function_code(func), env);
-        lt_vector_push(stack, func);
-      }
-        break;
-      case GSET: {
-        lisp_object_t *value = vlast(stack, 0);
-        lisp_object_t *var = op_gset_var(ins);
-        symbol_value(var) = value;
-      }
-        break;
-      case GVAR: {
-        lisp_object_t *sym = op_gvar_var(ins);
-        if (symbol_value(sym) == the_undef) {
-          char msg[256];
-          sprintf(msg, "Undefined global variable %s", symbol_name(sym));
-          lt_vector_push(stack, signal_exception(strdup(msg)));
-          goto check_exception;
-        } else
-          lt_vector_push(stack, symbol_value(sym));
-      }
-        break;
-      case JUMP: pc = fixnum_value(op_jump_label(ins)) - 1; break;
-      case LSET: {
-        lisp_object_t *value = vlast(stack, 0);
-        lisp_object_t *i = op_lset_i(ins);
-        lisp_object_t *j = op_lset_j(ins);
-        set_local_var(env, fixnum_value(i), fixnum_value(j), value);
-      }
-        break;
-      case LVAR: {
-        lisp_object_t *i = op_lvar_i(ins);
-        lisp_object_t *j = op_lvar_j(ins);
-        lisp_object_t *value = locate_var(env, fixnum_value(i), fixnum_value(j));
-        lt_vector_push(stack, value);
-      }
-        break;
-      case MOVEARGS: {
-        lt *bindings = environment_bindings(env);
-        for (int i = fixnum_value(op_moveargs_count(ins)) - 1; i >= 0; i--) {
-          lt *val = lt_vector_pop(stack);
-          vector_value(bindings)[i] = val;
-          vector_last(bindings)++;
-        }
-      }
-        break;
-      case MVLIST: {
-        lt *vals = make_empty_list();
-        for (int i = 0; i < nvalues; i++)
-          vals = make_pair(lt_vector_pop(stack), vals);
-        lt_vector_push(stack, vals);
+  intptr_t *ip = code_stream(code);
+  lt **constants = code_constants(code);
+//  The values of the free variables of the current function
+  lt *closure = NULL;
+  ensure_stack(code_max_stack(code));
+  DISPATCH();
+#ifndef THREADED_CODE
+  dispatch:
+  switch (*ip) {
+#endif
+//  A box is a pair whose head is the value of the variable
+  CASE(BCSET) {
+    lt *box = vector_value(closure)[oprand(1)];
+    pair_head(box) = TOP(0);
+  }
+    NEXT(2);
+  CASE(BCVAR) {
+    lt *box = vector_value(closure)[oprand(1)];
+    PUSH(pair_head(box));
+  }
+    NEXT(2);
+  CASE(BLSET)
+    pair_head(local(1)) = TOP(0);
+    NEXT(2);
+  CASE(BLVAR)
+    PUSH(pair_head(local(1)));
+    NEXT(2);
+  CASE(BOX)
+    local(1) = make_pair(local(1), make_empty_list());
+    NEXT(2);
+  CASE(MVCALL)
+    is_multi = TRUE;
+    goto call;
+  CASE(CALL)
+    call:
+    fn = POP();
+    if (!is_lt_function(fn))
+      goto call_non_function;
+    if (!is_arity_match(fn, oprand(1)))
+      goto arity_error;
+    push_frame:
+    if (nframes == frame_limit) {
+      frames = copy_frames(frames, nframes, &frame_size);
+      frame_limit = frame_size;
+    }
+    frames[nframes].ip = ip + 2;
+    frames[nframes].code = code;
+    frames[nframes].closure = closure;
+    frames[nframes].fn = fn;
+    frames[nframes].is_multi = is_multi;
+    frames[nframes].base = base;
+    nframes++;
+    is_multi = FALSE;
+    goto enter_function;
+  CASE(TCALL)
+//    The callee takes over the frame of the current function, so the caller of
+//    the current function is returned to directly.
+    fn = POP();
+    if (!is_lt_function(fn))
+      goto call_non_function;
+    if (!is_arity_match(fn, oprand(1)))
+      goto arity_error;
+    tail_call:
+    memmove(stack + base, sp - oprand(1), oprand(1) * sizeof(lt *));
+    sp = stack + base + oprand(1);
+    enter_function: {
+    nargs = oprand(1);
+    int nrequired = function_nrequired(fn);
+//    The arguments become the first slots of the callee's frame
+    if (function_restp(fn)) {
+      lt *rest = the_empty_list;
+      for (; nargs > nrequired; nargs--)
+        rest = make_pair(POP(), rest);
+//      The slot is not counted by the caller when no rest argument is passed
+      ensure_stack(1);
+      PUSH(rest);
+    }
+    base = sp - stack - function_frame_size(fn);
+    closure = function_env(fn);
+    code = function_code(fn);
+    ip = code_stream(code);
+    constants = code_constants(code);
+    ensure_stack(code_max_stack(code));
+  }
+    DISPATCH();
+  call_non_function:
+    if (is_lt_primitive(fn)) {
+//      This is possible because the first element of a application list
+//      might be a compound expression, and this compound one will return
+//      a primitive function object at run-time, but the compiler is unable
+//      to generate a PRIM instruction at compile-time --- This is only
+//      happen when the first element is a symbol named a primitive function.
+      PUSH(fn);
+      goto call_primitive;
+    } else {
+      char msg[1000];
+      FILE *fp = fmemopen(msg, sizeof(msg), "w");
+      lt *file = make_output_port(fp);
+      writef(file, "The object %? at the first place is not a function", fn);
+      lt_close_out(file);
+      ex = signal_exception(strdup(msg));
+      goto raise;
+    }
+  arity_error:
+    if (oprand(1) < function_nrequired(fn))
+      ex = signal_exception("CALL - Too few arguments passed");
+    else
+      ex = signal_exception("CALL - Too many arguments passed");
+    goto raise;
+//  Unwinds the frames until a handler protecting the current instruction is
+//  found. Nothing is done for exceptions on the normal path.
+  raise: {
+    int top = nframes;
+    int pc = ip - code_stream(code);
+    handler_t *handler;
+    while ((handler = find_handler(code, pc)) == NULL && nframes > 0) {
+      frame_t *frame = &frames[--nframes];
+      code = frame->code;
+      constants = code_constants(code);
+      closure = frame->closure;
+      ip = frame->ip;
+      base = frame->base;
+//      Points to the CALL instruction
+      pc = ip - code_stream(code) - 1;
+    }
+//    The frames unwound are kept for the backtrace, so they must not be
+//    overwritten by the following calls.
+    if (top > nframes) {
+      lt_exception_backtrace(ex);
+      exception_frames(ex) = frames + nframes;
+      exception_nframes(ex) = top - nframes;
+      frame_limit = nframes;
+    }
+    if (handler == NULL) {
+      PUSH(ex);
+      goto halt;
+    }
+    exception_flag(ex) = FALSE;
+    is_multi = FALSE;
+    sp = stack + base + handler->depth;
+    PUSH(ex);
+    ip = code_stream(code) + handler->handler;
+  }
+    DISPATCH();
+  CASE(CHKTYPE) {
+    int index = oprand(1);
+    intptr_t mask = oprand(2);
+    int nargs = oprand(3);
+    lt *arg = sp[index - nargs];
+    if (is_type_satisfy(arg, mask) == FALSE) {
+      ex = type_error(make_fixnum(index), mask_pred(mask));
+      goto raise;
+    }
+  }
+    NEXT(4);
+  CASE(CONST)
+    PUSH(constant(1));
+    NEXT(2);
+  CASE(CSET)
+    vector_value(closure)[oprand(1)] = TOP(0);
+    NEXT(2);
+  CASE(CVAR)
+    PUSH(vector_value(closure)[oprand(1)]);
+    NEXT(2);
+  CASE(FJUMP)
+    if (isfalse(POP())) {
+      ip = jump_target(1);
+      DISPATCH();
+    }
+    NEXT(2);
+  CASE(FN) {
+    lisp_object_t *proto = constant(1);
+    lt *sources = function_env(proto);
+    lt *values = make_vector(vector_length(sources));
+    for (int k = 0; k < vector_length(sources); k++) {
+      lt *src = vector_value(sources)[k];
+      if (isfixnum(src))
+        vector_value(values)[k] = stack[base + fixnum_value(src)];
+      else
+        vector_value(values)[k] = vector_value(closure)[fixnum_value(pair_head(src))];
+    }
+    vector_last(values) = vector_length(values) - 1;
+    lt *func = make_function(function_args(proto), function_code(proto), values);
+    function_body(func) = function_body(proto);
+    function_nrequired(func) = function_nrequired(proto);
+    function_restp(func) = function_restp(proto);
+    function_frame_size(func) = function_frame_size(proto);
+    PUSH(func);
+  }
+    NEXT(2);
+  CASE(GSET) {
+    lisp_object_t *value = TOP(0);
+    lisp_object_t *var = constant(1);
+    symbol_value(var) = value;
+//    The functions into which the old value was inlined are compiled again
+    if (is_lt_pair(symbol_dependents(var)))
+      invalidate_dependents(var);
+  }
+    NEXT(2);
+//  The cached callee has been checked against the following call instruction
+  CASE(GCALL)
+    fn = symbol_value(constant(1));
+    if (fn == inline_cache(2)) {
+      ip += 3;
+      goto push_frame;
+    }
+    if (is_lt_function(fn) && is_arity_match(fn, ip[4]))
+      inline_cache(2) = fn;
+    goto global_cache_miss;
+  CASE(GTCALL)
+    fn = symbol_value(constant(1));
+    if (fn == inline_cache(2)) {
+      ip += 3;
+      goto tail_call;
+    }
+    if (is_lt_function(fn) && is_arity_match(fn, ip[4]))
+      inline_cache(2) = fn;
+    goto global_cache_miss;
+  CASE(GPRIM)
+    fn = symbol_value(constant(1));
+    if (fn == inline_cache(2)) {
+      ip += 3;
+      goto invoke_primitive;
+    }
+    if (is_lt_primitive(fn) && is_primitive_arity_match(fn, ip[4]))
+      inline_cache(2) = fn;
+    global_cache_miss:
+    if (fn == the_undef) {
+      char msg[256];
+      sprintf(msg, "Undefined global variable %s", ensure_symbol_name(constant(1)));
+      ex = signal_exception(strdup(msg));
+      goto raise;
+    }
+    PUSH(fn);
+    NEXT(3);
+  CASE(GVAR) {
+    lisp_object_t *sym = constant(1);
+    if (symbol_value(sym) == the_undef) {
+      char msg[256];
+      sprintf(msg, "Undefined global variable %s", ensure_symbol_name(sym));
+      ex = signal_exception(strdup(msg));
+      goto raise;
+    } else
+      PUSH(symbol_value(sym));
+  }
+    NEXT(2);
+  CASE(HALT)
+    goto halt;
+  CASE(JUMP)
+    ip = jump_target(1);
+    DISPATCH();
+  CASE(LSET)
+    local(1) = TOP(0);
+    NEXT(2);
+  CASE(LVAR)
+    PUSH(local(1));
+    NEXT(2);
+//  The values are followed by their count on the stack
+  CASE(MVBIND) {
+    int count = fixnum_value(POP());
+    for (; count < oprand(1); count++)
+      PUSH(make_empty_list());
+    sp -= count - oprand(1);
+  }
+    NEXT(2);
+  CASE(MVLIST) {
+    int count = fixnum_value(POP());
+    lt *vals = make_empty_list();
+    for (; count > 0; count--)
+      vals = make_pair(POP(), vals);
+    PUSH(vals);
+  }
+    NEXT(1);
+//  Drops the slots of the local variables under the values and their count
+  CASE(MVSLIDE)
+    nvals = fixnum_value(TOP(0)) + 1;
+    memmove(sp - nvals - oprand(1), sp - nvals, nvals * sizeof(lt *));
+    sp -= oprand(1);
+    NEXT(2);
+  CASE(POP)
+    sp--;
+    NEXT(1);
+  CASE(PRIM)
+    call_primitive: {
+    nargs = oprand(1);
+    fn = POP();
+    int arity = primitive_arity(fn);
+    int restp = primitive_restp(fn);
+//    Check the number of arguments passed
+    if (restp == TRUE) {
+      arity--;
+      if (nargs < arity) {
+        ex = signal_exception("Too few arguments passed");
+        goto raise;
       }
-        break;
-      case POP:
-        lt_vector_pop(stack);
-        break;
-      case POPENV:
-        env = environment_next(env);
-        break;
-			call_primitive:
-      case PRIM: {
-        nargs = fixnum_value(op_prim_nargs(ins));
-        lisp_object_t *func = lt_vector_pop(stack);
-        prim = func;
-        int arity = primitive_arity(func);
-        int restp = primitive_restp(func);
-//        Check the number of arguments passed
-        if (restp == TRUE) {
-          arity--;
-          if (nargs < arity)
-            return signal_exception("Too few arguments passed");
-        } else {
-          if (nargs > arity)
-            return signal_exception("PRIM - Too many arguments passed");
-          else if (nargs < arity)
-            return signal_exception("PRIM - Too few arguments passed");
-        }
-
-        lisp_object_t *val = NULL;
-        assert(is_lt_primitive(func));
-//        Preprocess the arguments on the stack if the primitive function takes
-//        a rest flag.
-        if (primitive_restp(func) == TRUE) {
-          assert(nargs >= primitive_arity(func) - 1);
-          lt *rest = make_empty_list();
-          for (int i = nargs - primitive_arity(func) + 1; i > 0; i--) {
-            lt *arg = lt_vector_pop(stack);
-            rest = make_pair(arg, rest);
-          }
-          lt_vector_push(stack, rest);
-        }
-        switch (primitive_arity(func)) {
-          case 0:
-            val = ((f0)primitive_func(func))();
-            break;
-          case 1:
-            val = ((f1)primitive_func(func))(_arg1);
-            break;
-          case 2:
-            val = ((f2)primitive_func(func))(_arg1, _arg2);
-            break;
-          case 3:
-            val = ((f3)primitive_func(func))(_arg1, _arg2, _arg3);
-            break;
-          default :
-            fprintf(stdout, "Primitive function with arity %d is not supported\n", primitive_arity(func));
-            exit(1);
-        }
-        move_stack();
-        lt_vector_push(stack, val);
-//        When the primitive function's execution is finished, they will put the return
-//        value at the top of stack. If this return value is a signaled exception, and the
-//        local variable `throw_exception' is false, it means the last primitive function
-//        was called within a `try-with' block. Therefore, the exception object, as a
-//        return value, should be left at the top of stack, as the return value, and it
-//        will be used by the expandsion code of `try-with' block, in other word, CATCH
-//        by the language.
+    } else {
+      if (nargs > arity) {
+        ex = signal_exception("PRIM - Too many arguments passed");
+        goto raise;
+      } else if (nargs < arity) {
+        ex = signal_exception("PRIM - Too few arguments passed");
+        goto raise;
       }
-        break;
-      case RESTARGS: {
-        lt *rest = the_empty_list;
-        while (nargs > fixnum_value(op_restargs_count(ins))) {
-          lt *arg = lt_vector_pop(stack);
-          rest = make_pair(arg, rest);
-          nargs--;
-        }
-        lt_vector_push(stack, rest);
+    }
+  }
+    invoke_primitive: {
+    nargs = oprand(1);
+    lisp_object_t *func = fn;
+    lisp_object_t *val = NULL;
+    assert(is_lt_primitive(func));
+//    Preprocess the arguments on the stack if the primitive function takes
+//    a rest flag.
+    if (primitive_restp(func) == TRUE) {
+      assert(nargs >= primitive_arity(func) - 1);
+      lt *rest = make_empty_list();
+      for (int i = nargs - primitive_arity(func) + 1; i > 0; i--) {
+        lt *arg = POP();
+        rest = make_pair(arg, rest);
       }
+      PUSH(rest);
+    }
+    switch (primitive_arity(func)) {
+      case 0:
+        val = ((f0)primitive_func(func))();
         break;
-      case RETURN: {
-        if (isnull(return_stack))
-          break;
-        lisp_object_t *retaddr = pair_head(return_stack);
-        if (debug)
-          writef(standard_out, "retaddr is %?\n", retaddr);
-
-        return_stack = pair_tail(return_stack);
-        code = retaddr_code(retaddr);
-        env = retaddr_env(retaddr);
-        is_multi = retaddr_is_multi(retaddr);
-        nvalues = retaddr_nvalues(retaddr);
-        pc = retaddr_pc(retaddr);
-        throw_exception = retaddr_throw_flag(retaddr);
-      }
+      case 1:
+        val = ((f1)primitive_func(func))(_arg1);
         break;
-      case SETMV: is_multi = TRUE; break;
-      case VALUES:
-        assert(!isnull(return_stack));
-        retaddr_nvalues(pair_head(return_stack)) = fixnum_value(op_values_count(ins));
+      case 2:
+        val = ((f2)primitive_func(func))(_arg1, _arg2);
         break;
-      case CONS:
-        arg2 = lt_vector_pop(stack);
-        arg1 = lt_vector_pop(stack);
-        lt_vector_push(stack, make_pair(arg1, arg2));
+      case 3:
+        val = ((f3)primitive_func(func))(_arg1, _arg2, _arg3);
         break;
       default :
-        fprintf(stdout, "In run_by_llam --- Invalid opcode %d\n", opcode_name(ins));
+        fprintf(stdout, "Primitive function with arity %d is not supported\n", primitive_arity(func));
         exit(1);
     }
-    if (debug)
-      writef(standard_out, "stack is %?\n", stack);
-    pc++;
+    move_stack();
+//    Primitive functions signal an exception by returning it
+    if (is_signaled(val) && is_check_exception) {
+      if (isnull(exception_backtrace(val)) && exception_nframes(val) == 0)
+        exception_backtrace(val) = list1(func);
+      ex = val;
+      goto raise;
+    }
+    PUSH(val);
+    if (is_multi) {
+      PUSH(make_fixnum(1));
+      is_multi = FALSE;
+    }
+  }
+    NEXT(2);
+  CASE(RETURN)
+//    Returning from the top-level code finishes the execution
+    if (nframes == 0)
+      goto halt;
+    nvals = 1;
+    if (frames[nframes - 1].is_multi) {
+      PUSH(make_fixnum(1));
+      nvals = 2;
+    }
+    return_to_caller: {
+//    The values replace the arguments and the local variables of the callee
+    memmove(stack + base, sp - nvals, nvals * sizeof(lt *));
+    sp = stack + base + nvals;
+    frame_t *frame = &frames[--nframes];
+    code = frame->code;
+    constants = code_constants(code);
+    closure = frame->closure;
+    ip = frame->ip;
+    base = frame->base;
+  }
+    DISPATCH();
+//  Returns all the values if the caller wants them, otherwise only the first one
+  CASE(VALUES)
+    nvals = 1;
+    if (nframes > 0 && frames[nframes - 1].is_multi) {
+      PUSH(make_fixnum(oprand(1)));
+      nvals = oprand(1) + 1;
+    } else if (oprand(1) == 0)
+      PUSH(make_empty_list());
+    else
+      sp -= oprand(1) - 1;
+    if (nframes == 0)
+      goto halt;
+    goto return_to_caller;
+  CASE(SLIDE)
+    sp[-1 - oprand(1)] = TOP(0);
+    sp -= oprand(1);
+    NEXT(2);
+  CASE(CONS)
+    CHECK_OP_FN();
+    arg2 = POP();
+    arg1 = POP();
+    PUSH(make_pair(arg1, arg2));
+    NEXT(3);
+  CASE(EQ)
+    CHECK_OP_FN();
+    arg2 = POP();
+    arg1 = POP();
+    PUSH(booleanize(arg1 == arg2));
+    NEXT(3);
+  CASE(ADD)
+    FIXNUM_OP(__builtin_add_overflow(fixnum_value(arg1), fixnum_value(arg2), &fx), lt_g_add2(arg1, arg2));
+  CASE(SUB)
+    FIXNUM_OP(__builtin_sub_overflow(fixnum_value(arg1), fixnum_value(arg2), &fx), lt_g_sub2(arg1, arg2));
+  CASE(MUL)
+    FIXNUM_OP(__builtin_mul_overflow(fixnum_value(arg1), fixnum_value(arg2), &fx), lt_g_mul2(arg1, arg2));
+//  Fixnums with the same tag are compared directly
+  CASE(NUMEQ)
+    BINARY_OP(booleanize(arg1 == arg2), is_tower_number, lt_g_eq2(arg1, arg2));
+  CASE(GT)
+    BINARY_OP(booleanize((intptr_t)arg1 > (intptr_t)arg2), is_real_number, lt_gt(arg1, arg2));
+  CASE(LT)
+    BINARY_OP(booleanize((intptr_t)arg1 < (intptr_t)arg2), is_real_number, lt_gt(arg2, arg1));
+//  The value is pushed for the FJUMP following a superinstruction, which is run
+//  next like the one following any other opcode.
+  call_op_fn:
+    fn = symbol_value(constant(1));
+    arg2 = POP();
+    arg1 = POP();
+    if (fn == the_undef) {
+      char msg[256];
+      sprintf(msg, "Undefined global variable %s", ensure_symbol_name(constant(1)));
+      ex = signal_exception(strdup(msg));
+      goto raise;
+    }
+    if (!is_lt_function(fn) && !is_lt_primitive(fn))
+      goto call_non_function;
+    arg1 = lt_simple_apply(fn, list2(arg1, arg2));
+    if (is_signaled(arg1)) {
+      ex = arg1;
+      goto raise;
+    }
+    PUSH(arg1);
+    NEXT(3);
+  CASE(CONST_GPRIM)
+    PUSH(constant(1));
+    FALL_INTO(GPRIM, 2);
+  CASE(FJUMP_LVAR)
+    if (isfalse(POP())) {
+      ip = jump_target(1);
+      DISPATCH();
+    }
+    ip += 2;
+    PUSH(local(1));
+    NEXT(2);
+  CASE(GT_FJUMP)
+    COMPARE_JUMP((intptr_t)arg1 > (intptr_t)arg2, is_real_number, lt_gt(arg1, arg2));
+  CASE(LT_FJUMP)
+    COMPARE_JUMP((intptr_t)arg1 < (intptr_t)arg2, is_real_number, lt_gt(arg2, arg1));
+  CASE(LVAR_CONST)
+    PUSH(local(1));
+    PUSH(constant(3));
+    NEXT(4);
+  CASE(LVAR_GCALL)
+    PUSH(local(1));
+    FALL_INTO(GCALL, 2);
+  CASE(LVAR_GPRIM)
+    PUSH(local(1));
+    FALL_INTO(GPRIM, 2);
+  CASE(LVAR_LVAR)
+    PUSH(local(1));
+    PUSH(local(3));
+    NEXT(4);
+  CASE(NUMEQ_FJUMP)
+    COMPARE_JUMP(arg1 == arg2, is_tower_number, lt_g_eq2(arg1, arg2));
+#ifndef THREADED_CODE
+    default :
+      fprintf(stdout, "In run_by_llam --- Invalid opcode %ld\n", *ip);
+      exit(1);
   }
+#endif
   halt:
-  assert(isfalse(lt_is_vector_empty(stack)));
-  return vlast(stack, 0);
+  assert(sp > stack);
+  return TOP(0);
 }
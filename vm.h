@@ -8,8 +8,19 @@
 #ifndef VM_H_
 #define VM_H_
 
+#include <stdint.h>
+
 #include "type.h"
 
+// Dispatches the instructions by computed goto when the compiler supports
+// taking the address of a label, otherwise by a switch statement.
+#if defined(__GNUC__) && !defined(NO_THREADED_CODE)
+#define THREADED_CODE
+#endif
+
+extern int is_type_satisfy(lt *, intptr_t);
 extern lt *run_by_llam(lt *);
+extern intptr_t vm_opcode_word(enum OPCODE_TYPE);
+extern enum OPCODE_TYPE vm_word_opcode(intptr_t);
 
 #endif /* VM_H_ */